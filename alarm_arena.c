@@ -0,0 +1,113 @@
+/*
+ * alarm_arena.c
+ *
+ * Message arena: see alarm_arena.h. Allocation takes a block of
+ * the right size off its free list, or else bumps "next"; a block
+ * never straddles two chunks, so the tail of a chunk that cannot
+ * hold the next block is put on the free lists instead.
+ */
+#include "errors.h"
+#include "alarm_arena.h"
+
+static size_t arena_units(size_t length)
+{
+    return (length + 1 + ARENA_UNIT - 1) / ARENA_UNIT;
+}
+
+/*
+ * Put a free block on its list. The first four bytes of a free
+ * block hold the next free reference.
+ */
+static void arena_push(alarm_arena_t *arena, arena_ref_t ref, size_t units)
+{
+    memcpy(arena_text(arena, ref), &arena->free[units], sizeof(arena_ref_t));
+    arena->free[units] = ref;
+}
+
+void arena_init(alarm_arena_t *arena)
+{
+    int status;
+
+    memset(arena, 0, sizeof(*arena));
+    status = pthread_mutex_init(&arena->lock, NULL);
+    if (status != 0)
+        err_abort(status, "Init arena lock");
+    arena->next = 1; // Unit 0 is the null reference
+}
+
+/*
+ * Copy "text" into the arena and return its reference. Text longer
+ * than the largest block is truncated.
+ */
+arena_ref_t arena_store(alarm_arena_t *arena, const char *text)
+{
+    size_t length = strlen(text), units, left, chunk;
+    arena_ref_t ref;
+    char *block;
+    int status;
+
+    if (length > ARENA_CLASSES * ARENA_UNIT - 1)
+        length = ARENA_CLASSES * ARENA_UNIT - 1;
+    units = arena_units(length);
+
+    status = pthread_mutex_lock(&arena->lock);
+    if (status != 0)
+        err_abort(status, "Lock arena");
+    if ((ref = arena->free[units]) != 0)
+        memcpy(&arena->free[units], arena_text(arena, ref), sizeof(arena_ref_t));
+    else
+    {
+        left = ARENA_CHUNK_UNITS - arena->next % ARENA_CHUNK_UNITS;
+        if (arena->next % ARENA_CHUNK_UNITS != 0 && left < units)
+        {
+            // Recycle the end of the chunk, then start a new one
+            arena_push(arena, arena->next, left);
+            arena->next += left;
+        }
+        chunk = arena->next / ARENA_CHUNK_UNITS;
+        if (chunk >= ARENA_CHUNKS_MAX)
+        {
+            fprintf(stderr, "Message arena is full\n");
+            abort();
+        }
+        if (arena->chunks[chunk] == NULL)
+        {
+            arena->chunks[chunk] = malloc((size_t)ARENA_CHUNK_UNITS * ARENA_UNIT);
+            if (arena->chunks[chunk] == NULL)
+                errno_abort("Allocate arena chunk");
+        }
+        ref = arena->next;
+        arena->next += units;
+    }
+    arena->bytes += units * ARENA_UNIT;
+    status = pthread_mutex_unlock(&arena->lock);
+    if (status != 0)
+        err_abort(status, "Unlock arena");
+
+    block = arena_text(arena, ref);
+    memcpy(block, text, length);
+    block[length] = '\0';
+    return ref;
+}
+
+/*
+ * Free a block. Its size is worked out from the text it holds, so
+ * this must be called before anything else writes to it.
+ */
+void arena_release(alarm_arena_t *arena, arena_ref_t ref)
+{
+    size_t units;
+    int status;
+
+    if (ref == 0)
+        return;
+    units = arena_units(strlen(arena_text(arena, ref)));
+    status = pthread_mutex_lock(&arena->lock);
+    if (status != 0)
+        err_abort(status, "Lock arena");
+    arena_push(arena, ref, units);
+    arena->bytes -= units * ARENA_UNIT;
+    status = pthread_mutex_unlock(&arena->lock);
+    if (status != 0)
+        err_abort(status, "Unlock arena");
+}
@@ -0,0 +1,47 @@
+#ifndef __alarm_arena_h
+#define __alarm_arena_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Out-of-line storage for alarm message text. Messages live in
+ * 1 MiB chunks that never move, and an alarm refers to its text by
+ * a 32-bit offset counted in 16-byte units, so the alarm node
+ * itself stays small. Freed blocks go on one free list per size
+ * (1 to ARENA_CLASSES units); a block's size follows from the
+ * length of the NUL-terminated text it holds, so blocks carry no
+ * header. Offset 0 is never handed out and means "no message".
+ */
+#define ARENA_UNIT 16
+#define ARENA_CHUNK_UNITS 65536 /* 1 MiB chunks */
+#define ARENA_CHUNKS_MAX 4096   /* Up to 4 GiB of text */
+#define ARENA_CLASSES 16        /* Longest message: 255 bytes */
+
+typedef uint32_t arena_ref_t;
+
+typedef struct alarm_arena_tag
+{
+    pthread_mutex_t lock;               /* Protects everything but "chunks" contents */
+    char *chunks[ARENA_CHUNKS_MAX];     /* Written once, before any ref into them */
+    uint32_t next;                      /* Next unit never handed out */
+    arena_ref_t free[ARENA_CLASSES + 1]; /* Free list heads, by size in units */
+    size_t bytes;                       /* Bytes in live blocks */
+} alarm_arena_t;
+
+void arena_init(alarm_arena_t *arena);
+arena_ref_t arena_store(alarm_arena_t *arena, const char *text);
+void arena_release(alarm_arena_t *arena, arena_ref_t ref);
+
+/*
+ * The text a reference points to. The chunk table entry was
+ * written before the reference was created, so no lock is needed.
+ */
+static inline char *arena_text(alarm_arena_t *arena, arena_ref_t ref)
+{
+    return arena->chunks[ref / ARENA_CHUNK_UNITS] +
+           (size_t)(ref % ARENA_CHUNK_UNITS) * ARENA_UNIT;
+}
+
+#endif
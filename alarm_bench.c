@@ -0,0 +1,593 @@
+/*
+ * alarm_bench.c
+ *
+ * Load generator and expiry-lateness benchmark for the alarm
+ * programs. It starts one of them with its standard input on a
+ * pipe and its standard output on a pseudo-terminal (so that stdio
+ * in the program is line buffered, as it would be for a person),
+ * feeds it a workload of Start_Alarm, Change_Alarm and Cancel_Alarm commands
+ * (alarm_workload.h), and watches the output for expiries. Every alarm's
+ * message is "bench <id>", which is how an expiry line is matched
+ * to the deadline the bench computed when it sent the command.
+ *
+ * Lateness is measured from that deadline to the moment the bench
+ * reads the expiry line, so it includes the program's output path
+ * as well as its timer. CPU time and peak RSS come from wait4.
+ *
+ *      alarm_bench [options] <variant> <program> [program options]
+ *      alarm_bench [options] <variant>=<program> ...
+ *
+ * <variant> says which command and output format the program
+ * speaks: "cond" (alarm_cond.c), "new_cond" (new_alarm_cond.c) or
+ * "victor" (new_alarm_victor.c). The second form runs one workload
+ * through several programs in turn, for a side-by-side table; a
+ * recorded workload (-W to record, -w to replay) can be run again
+ * later. Each run is made from a child process of its own, so that
+ * every program starts from the same state; "-f csv" or "-f json"
+ * prints the results as a table.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include "errors.h"
+#include "alarm_parse.h"
+#include "alarm_time.h"
+#include "alarm_workload.h"
+
+#define BENCH_BUFFER (64 * 1024)
+#define EXPIRY_GRACE (5 * NSEC_PER_SEC)    /* Wait this long past the last deadline */
+#define RUNS_MAX 16                        /* Programs compared in one table */
+
+#define FORMAT_TEXT 0
+#define FORMAT_CSV 1
+#define FORMAT_JSON 2
+
+typedef struct variant_tag
+{
+    const char *name;
+    const char *start;  /* printf format of (timeout, id, group) */
+    const char *change; /* Same, or NULL if the program has no Change_Alarm */
+    const char *cancel; /* printf format of (id), or NULL if it has no Cancel_Alarm */
+    const char *expiry; /* Text that marks an expiry line */
+} variant_t;
+
+static const variant_t variants[] = {
+    {"cond", "%1$s bench %2$d\n", NULL, NULL, ") bench "},
+    {"new_cond", "Start_Alarm(%2$d): Group(%3$d) %1$s bench %2$d\n",
+     "Change_Alarm(%2$d): Group(%3$d) %1$s bench %2$d\n", NULL, ") bench "},
+    {"victor", "Start_Alarm(%2$d): Group(%3$d) %1$s bench %2$d\n",
+     "Change_Alarm(%2$d): Group(%3$d) %1$s bench %2$d\n", "Cancel_Alarm(%d)\n",
+     "Has Removed Alarm("},
+};
+
+/*
+ * What one run measured, written by the child that made it.
+ */
+typedef struct result_tag
+{
+    long started, changes, cancelled, skipped, expired;
+    double seconds;
+    double p50_ms, p90_ms, p99_ms, p999_ms, max_ms;
+    double user_s, sys_s;
+    long peak_rss_kb;
+    int finished;
+} result_t;
+
+static workload_t workload;
+
+static const variant_t *variant;
+static int to_program;         /* Pipe to the program's stdin */
+static int from_program;       /* Pseudo-terminal master */
+
+/*
+ * Per-alarm state, shared by the sending and the reading thread.
+ * The deadline is stored before the command that sets it is
+ * written, so the reader never sees an expiry before its deadline.
+ */
+static _Atomic uint64_t *deadline; /* 0: not started */
+static atomic_char *expired;
+static uint64_t *lateness;
+static atomic_long started;        /* Start commands sent */
+static atomic_long cancelled;      /* Cancel commands sent */
+static long changes, skipped, expiries;
+static uint64_t send_begin, send_end;
+static atomic_int sent_all;        /* The sender is done */
+static _Atomic uint64_t last_deadline;
+
+static void write_all(int fd, const char *buf, size_t size)
+{
+    ssize_t bytes;
+
+    while (size > 0)
+    {
+        bytes = write(fd, buf, size);
+        if (bytes == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            errno_abort("Write commands");
+        }
+        buf += bytes;
+        size -= bytes;
+    }
+}
+
+/*
+ * Append a workload command to "buf". Returns the length, or 0 if
+ * the program cannot take the command.
+ */
+static size_t format_command(char *buf, size_t size, const workload_op_t *op)
+{
+    const char *format = variant->start;
+    char text[32];
+    int length;
+
+    if (op->type == COMMAND_CANCEL)
+    {
+        if (variant->cancel == NULL)
+        {
+            skipped++;
+            return 0;
+        }
+        atomic_fetch_add(&cancelled, 1);
+        length = snprintf(buf, size, variant->cancel, op->alarm_id);
+        return length < 0 ? 0 : (size_t)length;
+    }
+    if (op->type == COMMAND_CHANGE)
+    {
+        if ((format = variant->change) == NULL)
+        {
+            skipped++;
+            return 0;
+        }
+        changes++;
+    }
+    else
+        atomic_fetch_add(&started, 1);
+    length = snprintf(buf, size, format, workload_timeout_text(op->timeout, text, sizeof(text)),
+                      op->alarm_id, op->group_id);
+    return length < 0 ? 0 : (size_t)length;
+}
+
+/*
+ * The sending thread: write the workload's commands, in batches,
+ * each no earlier than its submission offset.
+ */
+static void *sender(void *arg)
+{
+    static char buf[BENCH_BUFFER];
+    static const workload_op_t *batch_ops[BENCH_BUFFER / 16];
+    const workload_op_t *op;
+    struct timespec wake;
+    size_t next = 0, used, length;
+    long batch, i;
+    uint64_t now, due, latest;
+
+    send_begin = monotonic_ns();
+    while (next < workload.count)
+    {
+        now = monotonic_ns();
+        if (send_begin + workload.ops[next].at > now)
+        {
+            wake = ns_to_timespec(send_begin + workload.ops[next].at);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+            continue;
+        }
+
+        used = 0;
+        batch = 0;
+        while (next < workload.count && send_begin + workload.ops[next].at <= now &&
+               used + 256 < sizeof(buf) && batch < BENCH_BUFFER / 16)
+        {
+            op = &workload.ops[next++];
+            length = format_command(buf + used, sizeof(buf) - used, op);
+            if (length == 0)
+                continue;
+            used += length;
+            batch_ops[batch++] = op;
+        }
+
+        // The deadlines start now; publish them before the program can act on them
+        now = monotonic_ns();
+        latest = atomic_load(&last_deadline);
+        for (i = 0; i < batch; i++)
+        {
+            if (batch_ops[i]->type == COMMAND_CANCEL)
+                continue; // Never expires; the count of cancels tells the reader not to wait for it
+            due = now + batch_ops[i]->timeout;
+            atomic_store(&deadline[batch_ops[i]->alarm_id], due);
+            if (due > latest)
+                latest = due;
+        }
+        atomic_store(&last_deadline, latest);
+        write_all(to_program, buf, used);
+    }
+    send_end = monotonic_ns();
+    atomic_store(&sent_all, 1);
+    return NULL;
+}
+
+/*
+ * Look for an expiry in one line of output.
+ */
+static void scan_line(const char *line, uint64_t now)
+{
+    const char *tag;
+    long id;
+
+    if (strstr(line, variant->expiry) == NULL || (tag = strstr(line, "bench ")) == NULL)
+        return;
+    id = strtol(tag + 6, NULL, 10);
+    if (id < 1 || id > workload.max_id || atomic_load(&deadline[id]) == 0 ||
+        atomic_exchange(&expired[id], 1))
+        return;
+    lateness[expiries++] = now > atomic_load(&deadline[id]) ? now - atomic_load(&deadline[id]) : 0;
+}
+
+/*
+ * Read the program's output until every started alarm that was not
+ * cancelled has expired,
+ * or until the last deadline is well past.
+ */
+static void read_output(pthread_t thread)
+{
+    static char buf[BENCH_BUFFER];
+    struct pollfd input = {from_program, POLLIN, 0};
+    size_t used = 0;
+    ssize_t bytes;
+    char *line, *newline;
+    uint64_t now;
+    int sending = 1;
+
+    while (1)
+    {
+        if (sending && atomic_load(&sent_all))
+        {
+            pthread_join(thread, NULL);
+            sending = 0;
+        }
+        if (!sending && expiries == atomic_load(&started) - atomic_load(&cancelled))
+            return;
+        if (!sending && monotonic_ns() > atomic_load(&last_deadline) + EXPIRY_GRACE)
+            return;
+        if (poll(&input, 1, 100) <= 0)
+            continue;
+        bytes = read(from_program, buf + used, sizeof(buf) - 1 - used);
+        if (bytes <= 0)
+            return; // The program is gone
+        now = monotonic_ns();
+        used += bytes;
+        buf[used] = '\0';
+        for (line = buf; (newline = strchr(line, '\n')) != NULL; line = newline + 1)
+        {
+            *newline = '\0';
+            scan_line(line, now);
+        }
+        used -= line - buf;
+        memmove(buf, line, used);
+        if (used == sizeof(buf) - 1)
+            used = 0; // A line this long is not one of ours
+    }
+}
+
+/*
+ * Start the program ("args" is its argv) with its stdin on a pipe
+ * and its stdout on a raw pseudo-terminal. Returns its pid.
+ */
+static pid_t start_program(char *const args[])
+{
+    struct termios raw;
+    int pipe_fds[2], terminal, null;
+    pid_t pid;
+
+    from_program = posix_openpt(O_RDWR | O_NOCTTY);
+    if (from_program == -1 || grantpt(from_program) == -1 || unlockpt(from_program) == -1)
+        errno_abort("Open pseudo-terminal");
+    terminal = open(ptsname(from_program), O_RDWR | O_NOCTTY);
+    if (terminal == -1)
+        errno_abort("Open pseudo-terminal slave");
+    if (tcgetattr(terminal, &raw) == 0)
+    {
+        cfmakeraw(&raw);
+        tcsetattr(terminal, TCSANOW, &raw);
+    }
+    if (pipe(pipe_fds) == -1)
+        errno_abort("Create command pipe");
+
+    pid = fork();
+    if (pid == -1)
+        errno_abort("Fork program");
+    if (pid == 0)
+    {
+        null = open("/dev/null", O_WRONLY);
+        dup2(pipe_fds[0], STDIN_FILENO);
+        dup2(terminal, STDOUT_FILENO);
+        if (null != -1)
+            dup2(null, STDERR_FILENO); // Rejected commands are not interesting here
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        close(terminal);
+        close(from_program);
+        execv(args[0], args);
+        _exit(127);
+    }
+    close(pipe_fds[0]);
+    close(terminal);
+    to_program = pipe_fds[1];
+    return pid;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(double fraction)
+{
+    long index;
+
+    if (expiries == 0)
+        return 0;
+    index = (long)ceil(fraction * expiries) - 1;
+    if (index < 0)
+        index = 0;
+    return lateness[index] / 1e6;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-n commands] [-r rate] [-t timeouts] [-g groups] [-c change_ratio]\n"
+            "          [-x cancel_ratio] [-s seed] [-w workload] [-W workload] [-f text|csv|json]\n"
+            "          <cond|new_cond|victor> <program> [program options]\n"
+            "       %s [options] <cond|new_cond|victor>=<program> ...\n"
+            "  timeouts (seconds): fixed:T, uniform:LO:HI, exp:MEAN or skew:HI:K:P\n"
+            "  -w replays a recorded workload, -W records the one that is run\n",
+            name, name);
+    exit(2);
+}
+
+static const variant_t *variant_find(const char *name, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(variants) / sizeof(variants[0]); i++)
+        if (strlen(variants[i].name) == length && strncmp(variants[i].name, name, length) == 0)
+            return &variants[i];
+    return NULL;
+}
+
+/*
+ * Run the workload through one program ("args" is its argv), in
+ * the calling process, and fill in "result".
+ */
+static void run_program(char *const args[], result_t *result)
+{
+    struct rusage usage_info;
+    pthread_t thread;
+    int status;
+    pid_t pid;
+
+    deadline = calloc(workload.max_id + 1, sizeof(*deadline));
+    expired = calloc(workload.max_id + 1, sizeof(*expired));
+    lateness = calloc(workload.starts + 1, sizeof(*lateness));
+    if (deadline == NULL || expired == NULL || lateness == NULL)
+        errno_abort("Allocate bench state");
+
+    signal(SIGPIPE, SIG_IGN);
+    pid = start_program(args);
+    status = pthread_create(&thread, NULL, sender, NULL);
+    if (status != 0)
+        err_abort(status, "Create sender");
+    read_output(thread);
+
+    // End of input makes every variant exit
+    close(to_program);
+    if (wait4(pid, &status, 0, &usage_info) == -1)
+        errno_abort("Wait for program");
+
+    qsort(lateness, expiries, sizeof(*lateness), compare_ns);
+    result->started = atomic_load(&started);
+    result->changes = changes;
+    result->cancelled = atomic_load(&cancelled);
+    result->skipped = skipped;
+    result->expired = expiries;
+    result->seconds = (send_end - send_begin) / 1e9;
+    result->p50_ms = percentile_ms(0.5);
+    result->p90_ms = percentile_ms(0.9);
+    result->p99_ms = percentile_ms(0.99);
+    result->p999_ms = percentile_ms(0.999);
+    result->max_ms = percentile_ms(1.0);
+    result->user_s = usage_info.ru_utime.tv_sec + usage_info.ru_utime.tv_usec / 1e6;
+    result->sys_s = usage_info.ru_stime.tv_sec + usage_info.ru_stime.tv_usec / 1e6;
+    result->peak_rss_kb = usage_info.ru_maxrss;
+    result->finished = 1;
+}
+
+/*
+ * Make one run in a child process, so that it starts from the
+ * state the workload left, and collect its result.
+ */
+static void measure(const variant_t *run_variant, char *const args[], result_t *result)
+{
+    result_t *shared;
+    int status;
+    pid_t pid;
+
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        errno_abort("Map results");
+    memset(shared, 0, sizeof(*shared));
+    if (run_variant->change == NULL && workload.starts < workload.count)
+        fprintf(stderr, "%s has no Change_Alarm; sending starts only\n", run_variant->name);
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1)
+        errno_abort("Fork bench run");
+    if (pid == 0)
+    {
+        variant = run_variant;
+        run_program(args, shared);
+        _exit(0);
+    }
+    if (waitpid(pid, &status, 0) == -1)
+        errno_abort("Wait for bench run");
+    *result = *shared;
+    munmap(shared, sizeof(*shared));
+    if (!result->finished)
+        fprintf(stderr, "%s: run failed\n", run_variant->name);
+}
+
+static void print_result(const variant_t *run_variant, const result_t *result, int format,
+                         int first)
+{
+    long commands = (long)workload.count - result->skipped;
+    double throughput = result->seconds > 0 ? commands / result->seconds : 0;
+
+    if (format == FORMAT_JSON)
+        printf("%s  {\"variant\": \"%s\", \"commands\": %ld, \"starts\": %ld, \"changes\": %ld, "
+               "\"cancels\": %ld, \"submit_s\": %.6f, \"commands_per_s\": %.0f, "
+               "\"expired\": %ld, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, "
+               "\"p999_ms\": %.3f, \"max_ms\": %.3f, \"user_s\": %.3f, \"sys_s\": %.3f, "
+               "\"peak_rss_kb\": %ld}",
+               first ? "" : ",\n", run_variant->name, commands, result->started,
+               result->changes, result->cancelled, result->seconds, throughput,
+               result->expired, result->p50_ms, result->p90_ms, result->p99_ms,
+               result->p999_ms, result->max_ms, result->user_s, result->sys_s,
+               result->peak_rss_kb);
+    else if (format == FORMAT_CSV)
+        printf("%s,%ld,%ld,%ld,%ld,%.6f,%.0f,%ld,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%ld\n",
+               run_variant->name, commands, result->started, result->changes,
+               result->cancelled, result->seconds, throughput, result->expired,
+               result->p50_ms, result->p90_ms, result->p99_ms, result->p999_ms,
+               result->max_ms, result->user_s, result->sys_s, result->peak_rss_kb);
+    else
+    {
+        printf("%s: %zu commands (%ld starts, %ld changes, %ld cancels, %ld skipped) in %.3f s, %.0f commands/s\n",
+               run_variant->name, workload.count, result->started, result->changes,
+               result->cancelled, result->skipped, result->seconds, throughput);
+        printf("%s: expired %ld/%ld, lateness ms p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+               run_variant->name, result->expired, result->started - result->cancelled,
+               result->p50_ms, result->p90_ms, result->p99_ms, result->p999_ms, result->max_ms);
+        printf("%s: cpu user %.3f s sys %.3f s, peak rss %ld kB\n", run_variant->name,
+               result->user_s, result->sys_s, result->peak_rss_kb);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    workload_params_t params;
+    const variant_t *runs[RUNS_MAX];
+    char *programs[RUNS_MAX][2];
+    char *const *args[RUNS_MAX];
+    const char *load = NULL, *save = NULL;
+    char *equals;
+    result_t result;
+    int option, format = FORMAT_TEXT, count = 0, i;
+
+    workload_defaults(&params);
+    // Options after the program's name are the program's own
+    while ((option = getopt(argc, argv, "+n:r:t:g:c:x:s:w:W:f:")) != -1)
+    {
+        switch (option)
+        {
+        case 'n':
+            params.commands = atol(optarg);
+            break;
+        case 'r':
+            params.rate = atof(optarg);
+            break;
+        case 't':
+            if (workload_parse_timeouts(&params, optarg) != 0)
+                usage(argv[0]);
+            break;
+        case 'g':
+            params.groups = atoi(optarg);
+            break;
+        case 'c':
+            params.change_ratio = atof(optarg);
+            break;
+        case 'x':
+            params.cancel_ratio = atof(optarg);
+            break;
+        case 's':
+            params.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            load = optarg;
+            break;
+        case 'W':
+            save = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0)
+                format = FORMAT_CSV;
+            else if (strcmp(optarg, "json") == 0)
+                format = FORMAT_JSON;
+            else if (strcmp(optarg, "text") != 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc || params.commands < 1 || params.groups < 1 || params.rate < 0)
+        usage(argv[0]);
+
+    if (strchr(argv[optind], '=') == NULL)
+    {
+        // One program, with its own options
+        if (argc - optind < 2 ||
+            (runs[0] = variant_find(argv[optind], strlen(argv[optind]))) == NULL)
+            usage(argv[0]);
+        args[0] = argv + optind + 1;
+        count = 1;
+    }
+    else
+        for (; optind < argc; optind++, count++)
+        {
+            equals = strchr(argv[optind], '=');
+            if (count == RUNS_MAX || equals == NULL || equals[1] == '\0' ||
+                (runs[count] = variant_find(argv[optind], equals - argv[optind])) == NULL)
+                usage(argv[0]);
+            programs[count][0] = equals + 1;
+            programs[count][1] = NULL;
+            args[count] = programs[count];
+        }
+
+    if (load != NULL)
+    {
+        if (workload_load(&workload, load) != 0)
+            errno_abort("Load workload");
+    }
+    else
+        workload_generate(&workload, &params);
+    if (save != NULL && workload_save(&workload, save) != 0)
+        errno_abort("Save workload");
+
+    if (format == FORMAT_JSON)
+        printf("[\n");
+    else if (format == FORMAT_CSV)
+        printf("variant,commands,starts,changes,cancels,submit_s,commands_per_s,expired,"
+               "p50_ms,p90_ms,p99_ms,p999_ms,max_ms,user_s,sys_s,peak_rss_kb\n");
+    for (i = 0; i < count; i++)
+    {
+        measure(runs[i], args[i], &result);
+        print_result(runs[i], &result, format, i == 0);
+        fflush(stdout);
+    }
+    if (format == FORMAT_JSON)
+        printf("\n]\n");
+    return 0;
+}
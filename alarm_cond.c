@@ -13,69 +13,75 @@
 #include <pthread.h>
 #include <time.h>
 #include "errors.h"
+#include "alarm_wheel.h"
+#include "alarm_time.h"
+#include "alarm_slab.h"
+#include "alarm_lockstat.h"
 
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
+ * The "alarm" structure now contains the CLOCK_MONOTONIC deadline
+ * (in nanoseconds) for each alarm, so that they can be
+ * sorted. Storing the requested timeout would not be
  * enough, since the "alarm thread" cannot tell how long it has
  * been on the list.
  */
 typedef struct alarm_tag
 {
-    struct alarm_tag *link; // Pointer to next alarm
-    int seconds;
-    time_t time; /* seconds from EPOCH */
+    wheel_node_t timer; // Position in the timing wheel
+    uint64_t timeout;   /* requested timeout, nanoseconds */
+    uint64_t time;      /* CLOCK_MONOTONIC deadline, nanoseconds */
     char message[64];
 } alarm_t;
 
+/*
+ * Pending alarms are kept in a timing wheel that ticks once a
+ * millisecond, rather than in a sorted list, so that inserting an
+ * alarm does not have to walk every alarm that expires before it.
+ * current_alarm is the wheel tick the alarm thread waits for.
+ */
+#define WHEEL_TICK_NS NSEC_PER_MSEC
+
 pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
-alarm_t *alarm_list = NULL;
-time_t current_alarm = 0;
+slab_t alarm_slab; // Alarms are allocated by main and freed by the alarm thread
+pthread_cond_t alarm_cond;
+alarm_wheel_t alarm_wheel;
+uint64_t current_alarm = 0;
+
+#ifdef DEBUG
+/*
+ * Print one wheel entry for the DEBUG list dump.
+ */
+int alarm_print(wheel_node_t *node, void *arg)
+{
+    alarm_t *alarm = wheel_entry(node, alarm_t, timer);
+
+    printf("%llu(%lld)[\"%s\"] ", (unsigned long long)alarm->time,
+           (long long)(alarm->time - monotonic_ns()), alarm->message);
+    return 0;
+}
+#endif
 
 /*
- * Insert alarm entry on list, in order.
+ * Insert alarm entry into the timing wheel.
  */
 void alarm_insert(alarm_t *alarm)
 {
     int status;
-    alarm_t **last, *next;
 
     /*
      * LOCKING PROTOCOL:
      *
      * This routine requires that the caller have locked the
      * alarm_mutex!
+     *
+     * The deadline is rounded up to a whole tick, so that the
+     * alarm never fires early.
      */
-    last = &alarm_list;
-    next = *last;
-    while (next != NULL)
-    {
-        if (next->time >= alarm->time)
-        {
-            alarm->link = next;
-            *last = alarm;
-            break;
-        }
-        last = &next->link;
-        next = next->link;
-    }
-    /*
-     * If we reached the end of the list, insert the new alarm
-     * there.  ("next" is NULL, and "last" points to the link
-     * field of the last item, or to the list header.)
-     */
-    if (next == NULL)
-    {
-        *last = alarm;
-        alarm->link = NULL;
-    }
+    alarm->timer.expires = (alarm->time + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+    wheel_insert(&alarm_wheel, &alarm->timer);
 #ifdef DEBUG
     printf("[list: ");
-    for (next = alarm_list; next != NULL; next = next->link)
-        printf("%d(%d)[\"%s\"] ", next->time,
-               next->time - time(NULL), next->message);
+    wheel_walk(&alarm_wheel, alarm_print, NULL);
     printf("]\n");
 #endif
     /*
@@ -84,9 +90,9 @@ void alarm_insert(alarm_t *alarm)
      * work), or if the new alarm comes before the one on
      * which the alarm thread is waiting.
      */
-    if (current_alarm == 0 || alarm->time < current_alarm)
+    if (current_alarm == 0 || alarm->timer.expires < current_alarm)
     {
-        current_alarm = alarm->time;
+        current_alarm = alarm->timer.expires;
         status = pthread_cond_signal(&alarm_cond);
         if (status != 0)
             err_abort(status, "Signal cond");
@@ -99,9 +105,11 @@ void alarm_insert(alarm_t *alarm)
 void *alarm_thread(void *arg)
 {
     alarm_t *alarm;
+    wheel_node_t *expired;
     struct timespec cond_time;
-    time_t now;
-    int status, expired;
+    uint64_t next;
+    char timeout[32];
+    int status;
 
     /*
      * Loop forever, processing commands. The alarm thread will
@@ -109,57 +117,72 @@ void *alarm_thread(void *arg)
      * at the start -- it will be unlocked during condition
      * waits, so the main thread can insert alarms.
      */
-    status = pthread_mutex_lock(&alarm_mutex);
+    status = lockstat_mutex_lock(&alarm_mutex);
     if (status != 0)
         err_abort(status, "Lock mutex");
     while (1)
     {
         /*
-         * If the alarm list is empty, wait until an alarm is
-         * added. Setting current_alarm to 0 informs the insert
-         * routine that the thread is not busy.
+         * Move the wheel up to the current tick. That detaches
+         * every alarm that expired on the way as one list, so
+         * the mutex is released before they are reported and
+         * freed: the time it is held does not grow with the
+         * number of alarms that expire at once.
          */
-        current_alarm = 0;
-        while (alarm_list == NULL)
+        expired = wheel_advance(&alarm_wheel, monotonic_ns() / WHEEL_TICK_NS);
+        if (expired != NULL)
         {
-            status = pthread_cond_wait(&alarm_cond, &alarm_mutex);
+            status = lockstat_mutex_unlock(&alarm_mutex);
             if (status != 0)
-                err_abort(status, "Wait on cond");
+                err_abort(status, "Unlock mutex");
+            while (expired != NULL)
+            {
+                alarm = wheel_entry(expired, alarm_t, timer);
+                expired = expired->next;
+                printf("(%s) %s\n", format_timeout(alarm->timeout, timeout, sizeof(timeout)),
+                       alarm->message);
+                slab_free(&alarm_slab, alarm);
+            }
+            status = lockstat_mutex_lock(&alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Lock mutex");
+            continue; // More may have come due meanwhile
         }
-        alarm = alarm_list;
-        alarm_list = alarm->link;
-        now = time(NULL);
-        expired = 0;
-        if (alarm->time > now)
+
+        /*
+         * If the wheel is empty, wait until an alarm is added.
+         * Setting current_alarm to 0 informs the insert routine
+         * that the thread is not busy.
+         */
+        if (!wheel_next_tick(&alarm_wheel, &next))
         {
+            current_alarm = 0;
+            status = lockstat_cond_wait(&alarm_cond, &alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Wait on cond");
+            continue;
+        }
+
+        /*
+         * Otherwise wait for the next tick at which the wheel has
+         * work, which is either an expiry or the point where a
+         * later slot moves down a level. An insert of an earlier
+         * alarm changes current_alarm, and ends the wait.
+         */
 #ifdef DEBUG
-            printf("[waiting: %d(%d)\"%s\"]\n", alarm->time,
-                   alarm->time - time(NULL), alarm->message);
+        printf("[waiting: %llu(%lld)]\n", (unsigned long long)next,
+               (long long)(next * WHEEL_TICK_NS - monotonic_ns()));
 #endif
-            cond_time.tv_sec = alarm->time;
-            cond_time.tv_nsec = 0;
-            current_alarm = alarm->time;
-            while (current_alarm == alarm->time)
-            {
-                status = pthread_cond_timedwait(
-                    &alarm_cond, &alarm_mutex, &cond_time);
-                if (status == ETIMEDOUT)
-                {
-                    expired = 1;
-                    break;
-                }
-                if (status != 0)
-                    err_abort(status, "Cond timedwait");
-            }
-            if (!expired)
-                alarm_insert(alarm);
-        }
-        else
-            expired = 1;
-        if (expired)
+        cond_time = ns_to_timespec(next * WHEEL_TICK_NS);
+        current_alarm = next;
+        while (current_alarm == next)
         {
-            printf("(%d) %s\n", alarm->seconds, alarm->message);
-            free(alarm);
+            status = lockstat_cond_timedwait(
+                &alarm_cond, &alarm_mutex, &cond_time);
+            if (status == ETIMEDOUT)
+                break;
+            if (status != 0)
+                err_abort(status, "Cond timedwait");
         }
     }
 }
@@ -168,9 +191,27 @@ int main(int argc, char *argv[])
 {
     int status;
     char line[128];
+    char timeout[32];
     alarm_t *alarm;
     pthread_t thread;
+    pthread_condattr_t cond_attr;
 
+    /*
+     * The alarm thread's timed waits are measured against
+     * CLOCK_MONOTONIC, the same clock as the deadlines.
+     */
+    status = pthread_condattr_init(&cond_attr);
+    if (status != 0)
+        err_abort(status, "Init cond attr");
+    status = pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    if (status != 0)
+        err_abort(status, "Set cond clock");
+    status = pthread_cond_init(&alarm_cond, &cond_attr);
+    if (status != 0)
+        err_abort(status, "Init cond");
+    lockstat_init(); // Before any thread is created
+    wheel_init(&alarm_wheel, monotonic_ns() / WHEEL_TICK_NS);
+    slab_init(&alarm_slab, "alarm", sizeof(alarm_t));
     status = pthread_create(
         &thread, NULL, alarm_thread, NULL);
     if (status != 0)
@@ -182,33 +223,34 @@ int main(int argc, char *argv[])
             exit(0);
         if (strlen(line) <= 1)
             continue;
-        alarm = (alarm_t *)malloc(sizeof(alarm_t));
-        if (alarm == NULL)
-            errno_abort("Allocate alarm");
+        alarm = (alarm_t *)slab_alloc(&alarm_slab);
 
         /*
-         * Parse input line into seconds (%d) and a message
-         * (%64[^\n]), consisting of up to 64 characters
-         * separated from the seconds by whitespace.
+         * Parse input line into a timeout (%31s) and a message
+         * (%63[^\n]), consisting of up to 63 characters
+         * separated from the timeout by whitespace. The timeout
+         * is seconds, possibly fractional, or milliseconds with
+         * an "ms" suffix.
          */
-        if (sscanf(line, "%d %64[^\n]",
-                   &alarm->seconds, alarm->message) < 2)
+        if (sscanf(line, "%31s %63[^\n]",
+                   timeout, alarm->message) < 2 ||
+            parse_timeout(timeout, &alarm->timeout) != 0)
         {
             fprintf(stderr, "Bad command\n");
-            free(alarm);
+            slab_free(&alarm_slab, alarm);
         }
         else
         {
-            status = pthread_mutex_lock(&alarm_mutex);
+            status = lockstat_mutex_lock(&alarm_mutex);
             if (status != 0)
                 err_abort(status, "Lock mutex");
-            alarm->time = time(NULL) + alarm->seconds;
+            alarm->time = monotonic_ns() + alarm->timeout;
             /*
-             * Insert the new alarm into the list of alarms,
-             * sorted by expiration time.
+             * Insert the new alarm into the timing wheel, in
+             * the slot for its expiration time.
              */
             alarm_insert(alarm);
-            status = pthread_mutex_unlock(&alarm_mutex);
+            status = lockstat_mutex_unlock(&alarm_mutex);
             if (status != 0)
                 err_abort(status, "Unlock mutex");
         }
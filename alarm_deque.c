@@ -0,0 +1,127 @@
+/*
+ * alarm_deque.c
+ *
+ * Chase-Lev deque: see alarm_deque.h. The memory orderings follow
+ * Le, Pop, Cohen and Zappa Nardelli, "Correct and Efficient
+ * Work-Stealing for Weak Memory Models" (PPoPP 2013).
+ */
+#include <stdlib.h>
+#include "errors.h"
+#include "alarm_deque.h"
+
+static deque_array_t *array_create(int64_t size)
+{
+    deque_array_t *array;
+
+    array = calloc(1, sizeof(*array) + size * sizeof(array->items[0]));
+    if (array == NULL)
+        errno_abort("Allocate deque");
+    array->size = size;
+    return array;
+}
+
+/*
+ * Copy the live items into an array twice the size. Only the owner
+ * calls this.
+ */
+static deque_array_t *array_grow(work_deque_t *deque, deque_array_t *old, int64_t top, int64_t bottom)
+{
+    deque_array_t *array = array_create(old->size * 2);
+    int64_t i;
+
+    for (i = top; i < bottom; i++)
+        atomic_store_explicit(&array->items[i & (array->size - 1)],
+                              atomic_load_explicit(&old->items[i & (old->size - 1)], memory_order_relaxed),
+                              memory_order_relaxed);
+    array->retired = old;
+    atomic_store_explicit(&deque->array, array, memory_order_release);
+    return array;
+}
+
+void deque_init(work_deque_t *deque)
+{
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, array_create(DEQUE_INITIAL));
+}
+
+void deque_destroy(work_deque_t *deque)
+{
+    deque_array_t *array = atomic_load(&deque->array), *retired;
+
+    for (; array != NULL; array = retired)
+    {
+        retired = array->retired;
+        free(array);
+    }
+}
+
+/*
+ * Add an item at the bottom. Only the owner may push.
+ */
+void deque_push(work_deque_t *deque, void *item)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    deque_array_t *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+    if (bottom - top > array->size - 1)
+        array = array_grow(deque, array, top, bottom);
+    atomic_store_explicit(&array->items[bottom & (array->size - 1)], item, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+/*
+ * Take the most recently pushed item, or DEQUE_EMPTY. Only the
+ * owner may take.
+ */
+void *deque_take(work_deque_t *deque)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    deque_array_t *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    int64_t top;
+    void *item;
+
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom)
+    {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return DEQUE_EMPTY;
+    }
+    item = atomic_load_explicit(&array->items[bottom & (array->size - 1)], memory_order_relaxed);
+    if (top == bottom)
+    {
+        // The last item: whoever moves "top" first gets it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed))
+            item = DEQUE_EMPTY;
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+/*
+ * Take the oldest item. Any thread may steal. Returns DEQUE_EMPTY,
+ * or DEQUE_ABORT if another thread took the item first.
+ */
+void *deque_steal(work_deque_t *deque)
+{
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    int64_t bottom;
+    deque_array_t *array;
+    void *item;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom)
+        return DEQUE_EMPTY;
+    array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    item = atomic_load_explicit(&array->items[top & (array->size - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed))
+        return DEQUE_ABORT;
+    return item;
+}
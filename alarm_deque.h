@@ -0,0 +1,55 @@
+#ifndef __alarm_deque_h
+#define __alarm_deque_h
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * A Chase-Lev work-stealing deque of pointers. The thread that owns
+ * the deque pushes and takes at the bottom without any atomic
+ * read-modify-write, except when it races a thief for the last
+ * item; any other thread may steal from the top with one
+ * compare-and-swap. The owner works LIFO, which keeps its recent
+ * work in cache, and thieves take the oldest work.
+ *
+ * The array doubles when it fills. A replaced array is not freed,
+ * since a thief may still be reading it; it is kept on a list and
+ * released by deque_destroy.
+ */
+#define DEQUE_INITIAL 64 /* Starting capacity, a power of 2 */
+
+#define DEQUE_EMPTY ((void *)0)
+#define DEQUE_ABORT ((void *)1) /* Lost a race; try again */
+
+typedef struct deque_array_tag
+{
+    struct deque_array_tag *retired; /* Array this one replaced */
+    int64_t size;
+    _Atomic(void *) items[];
+} deque_array_t;
+
+typedef struct work_deque_tag
+{
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic(deque_array_t *) array;
+} work_deque_t;
+
+void deque_init(work_deque_t *deque);
+void deque_destroy(work_deque_t *deque);
+void deque_push(work_deque_t *deque, void *item);
+void *deque_take(work_deque_t *deque);
+void *deque_steal(work_deque_t *deque);
+
+/*
+ * Items in the deque; only a hint while thieves are active.
+ */
+static inline int64_t deque_size(work_deque_t *deque)
+{
+    int64_t size = atomic_load_explicit(&deque->bottom, memory_order_relaxed) -
+                   atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    return size < 0 ? 0 : size;
+}
+
+#endif
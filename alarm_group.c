@@ -0,0 +1,63 @@
+/*
+ * alarm_group.c
+ *
+ * Per-group member lists: see alarm_group.h.
+ */
+#include <stdlib.h>
+#include "errors.h"
+#include "alarm_group.h"
+
+void group_index_init(group_index_t *index)
+{
+    hash_init(&index->groups);
+}
+
+alarm_group_t *group_find(group_index_t *index, int group_id)
+{
+    return hash_find(&index->groups, group_id);
+}
+
+/*
+ * Make "node" a member of group "group_id", creating the group if
+ * this is its first member.
+ */
+void group_add(group_index_t *index, int group_id, group_node_t *node)
+{
+    alarm_group_t *group = hash_find(&index->groups, group_id);
+
+    if (group == NULL)
+    {
+        group = calloc(1, sizeof(*group));
+        if (group == NULL)
+            errno_abort("Allocate group");
+        group->group_id = group_id;
+        hash_insert(&index->groups, group_id, group);
+    }
+    node->next = group->first;
+    if (node->next != NULL)
+        node->next->pprev = &node->next;
+    group->first = node;
+    node->pprev = &group->first;
+    group->count++;
+}
+
+/*
+ * Take "node" out of group "group_id", which it must belong to.
+ */
+void group_remove(group_index_t *index, int group_id, group_node_t *node)
+{
+    alarm_group_t *group;
+
+    *node->pprev = node->next;
+    if (node->next != NULL)
+        node->next->pprev = node->pprev;
+    node->next = NULL;
+    node->pprev = NULL;
+
+    group = hash_find(&index->groups, group_id);
+    if (--group->count == 0)
+    {
+        hash_remove(&index->groups, group_id);
+        free(group);
+    }
+}
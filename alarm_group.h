@@ -0,0 +1,51 @@
+#ifndef __alarm_group_h
+#define __alarm_group_h
+
+#include <stddef.h>
+#include "alarm_hash.h"
+
+/*
+ * Secondary index of pending alarms by group. Each group that has
+ * members has an intrusive doubly linked list of them, found through
+ * a hash table keyed by group id, so adding, removing and moving an
+ * alarm between groups is O(1), and visiting a group costs only as
+ * much as the group has members. A group is freed when its last
+ * member leaves.
+ */
+typedef struct group_node_tag
+{
+    struct group_node_tag *next;
+    struct group_node_tag **pprev; /* Link that points at this node */
+} group_node_t;
+
+#define group_entry(node, type, member) \
+    ((type *)((char *)(node) - offsetof(type, member)))
+
+typedef struct alarm_group_tag
+{
+    int group_id;
+    size_t count;        /* Members */
+    group_node_t *first;
+} alarm_group_t;
+
+typedef struct group_index_tag
+{
+    alarm_hash_t groups; /* group_id to alarm_group_t */
+} group_index_t;
+
+void group_index_init(group_index_t *index);
+alarm_group_t *group_find(group_index_t *index, int group_id);
+void group_add(group_index_t *index, int group_id, group_node_t *node);
+void group_remove(group_index_t *index, int group_id, group_node_t *node);
+
+/*
+ * Number of pending alarms in a group.
+ */
+static inline size_t group_count(group_index_t *index, int group_id)
+{
+    alarm_group_t *group = group_find(index, group_id);
+
+    return group == NULL ? 0 : group->count;
+}
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ * alarm_hash.c
+ *
+ * Index from alarm_id to alarm node, so Change_Alarm requests go
+ * straight to the alarm they name instead of scanning every
+ * pending alarm. Ids are spread with Fibonacci hashing, which
+ * keeps runs of consecutive ids from landing in consecutive slots.
+ */
+#include "errors.h"
+#include "alarm_hash.h"
+
+#define HASH_INITIAL_BITS 6
+
+static size_t hash_index(alarm_hash_t *hash, int key)
+{
+    return (size_t)(((uint64_t)(uint32_t)key * 0x9E3779B97F4A7C15ull) >> hash->shift);
+}
+
+static void hash_alloc(alarm_hash_t *hash, int bits)
+{
+    hash->slots = calloc((size_t)1 << bits, sizeof(hash_slot_t));
+    if (hash->slots == NULL)
+        errno_abort("Allocate alarm hash");
+    hash->mask = ((size_t)1 << bits) - 1;
+    hash->shift = 64 - bits;
+    hash->count = 0;
+}
+
+/*
+ * Double the table once it is half full, which keeps the expected
+ * probe length for a miss under three slots.
+ */
+static void hash_resize(alarm_hash_t *hash, int bits)
+{
+    hash_slot_t *old = hash->slots;
+    size_t capacity = hash->mask + 1, i;
+
+    hash_alloc(hash, bits);
+    for (i = 0; i < capacity; i++)
+        if (old[i].value != NULL)
+            hash_insert(hash, old[i].key, old[i].value);
+    free(old);
+}
+
+void hash_init(alarm_hash_t *hash)
+{
+    hash_alloc(hash, HASH_INITIAL_BITS);
+}
+
+/*
+ * Grow the table, if need be, so that "count" keys fit without any
+ * further doubling. For bulk loads of a known size.
+ */
+void hash_reserve(alarm_hash_t *hash, size_t count)
+{
+    int bits = 64 - hash->shift;
+
+    while (((size_t)1 << bits) < count * 2)
+        bits++;
+    if (bits > 64 - hash->shift)
+        hash_resize(hash, bits);
+}
+
+void *hash_find(alarm_hash_t *hash, int key)
+{
+    size_t i;
+
+    for (i = hash_index(hash, key); hash->slots[i].value != NULL; i = (i + 1) & hash->mask)
+        if (hash->slots[i].key == key)
+            return hash->slots[i].value;
+    return NULL;
+}
+
+/*
+ * Add a key that is not in the table yet. Returns -1, and leaves
+ * the table alone, if the key is already present.
+ */
+int hash_insert(alarm_hash_t *hash, int key, void *value)
+{
+    size_t i;
+
+    if ((hash->count + 1) * 2 > hash->mask + 1)
+        hash_resize(hash, 64 - hash->shift + 1);
+    for (i = hash_index(hash, key); hash->slots[i].value != NULL; i = (i + 1) & hash->mask)
+        if (hash->slots[i].key == key)
+            return -1;
+    hash->slots[i].key = key;
+    hash->slots[i].value = value;
+    hash->count++;
+    return 0;
+}
+
+/*
+ * Remove a key, and return the value it mapped to (or NULL). The
+ * entries after the hole are moved back into it whenever their
+ * home slot allows, so that no probe run is ever broken.
+ */
+void *hash_remove(alarm_hash_t *hash, int key)
+{
+    size_t i, j, home;
+    void *value;
+
+    for (i = hash_index(hash, key); hash->slots[i].value != NULL; i = (i + 1) & hash->mask)
+        if (hash->slots[i].key == key)
+            break;
+    if ((value = hash->slots[i].value) == NULL)
+        return NULL;
+    for (j = (i + 1) & hash->mask; hash->slots[j].value != NULL; j = (j + 1) & hash->mask)
+    {
+        home = hash_index(hash, hash->slots[j].key);
+
+        /*
+         * The entry at j can fill the hole at i unless its home
+         * slot lies cyclically in (i, j].
+         */
+        if (((j - home) & hash->mask) >= ((j - i) & hash->mask))
+        {
+            hash->slots[i] = hash->slots[j];
+            i = j;
+        }
+    }
+    hash->slots[i].value = NULL;
+    hash->count--;
+    return value;
+}
@@ -0,0 +1,34 @@
+#ifndef __alarm_hash_h
+#define __alarm_hash_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Open-addressing hash table from alarm_id to the live alarm node,
+ * with linear probing. Deletion shifts the rest of the probe run
+ * back instead of leaving tombstones, so lookups of missing ids
+ * stay short no matter how much churn the table has seen. A NULL
+ * value marks an empty slot.
+ */
+typedef struct hash_slot_tag
+{
+    int key;
+    void *value;
+} hash_slot_t;
+
+typedef struct alarm_hash_tag
+{
+    hash_slot_t *slots;
+    size_t count;
+    size_t mask;  /* Capacity - 1; capacity is a power of two */
+    int shift;    /* 64 - log2(capacity), for Fibonacci hashing */
+} alarm_hash_t;
+
+void hash_init(alarm_hash_t *hash);
+void hash_reserve(alarm_hash_t *hash, size_t count);
+void *hash_find(alarm_hash_t *hash, int key);
+int hash_insert(alarm_hash_t *hash, int key, void *value);
+void *hash_remove(alarm_hash_t *hash, int key);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * alarm_heap.c
+ *
+ * Indexed 4-ary min-heap used as the pending-alarm store. A 4-ary
+ * heap is half as deep as a binary one, and the four children of
+ * a slot sit next to each other in the array, so a sift-down reads
+ * one or two cache lines per level.
+ */
+#include "errors.h"
+#include "alarm_heap.h"
+
+#define HEAP_INITIAL 64
+
+/*
+ * Store a slot and tell its node where it now lives.
+ */
+static void heap_set(alarm_heap_t *heap, size_t index, heap_slot_t slot)
+{
+    heap->slots[index] = slot;
+    slot.node->index = index;
+}
+
+static void heap_sift_up(alarm_heap_t *heap, size_t index)
+{
+    heap_slot_t slot = heap->slots[index];
+    size_t parent;
+
+    while (index > 0)
+    {
+        parent = (index - 1) / HEAP_ARITY;
+        if (heap->slots[parent].key <= slot.key)
+            break;
+        heap_set(heap, index, heap->slots[parent]);
+        index = parent;
+    }
+    heap_set(heap, index, slot);
+}
+
+static void heap_sift_down(alarm_heap_t *heap, size_t index)
+{
+    heap_slot_t slot = heap->slots[index];
+    size_t child, last, best;
+
+    while ((child = index * HEAP_ARITY + 1) < heap->count)
+    {
+        last = child + HEAP_ARITY;
+        if (last > heap->count)
+            last = heap->count;
+        for (best = child++; child < last; child++)
+            if (heap->slots[child].key < heap->slots[best].key)
+                best = child;
+        if (slot.key <= heap->slots[best].key)
+            break;
+        heap_set(heap, index, heap->slots[best]);
+        index = best;
+    }
+    heap_set(heap, index, slot);
+}
+
+void heap_init(alarm_heap_t *heap)
+{
+    heap->slots = NULL;
+    heap->count = 0;
+    heap->capacity = 0;
+}
+
+/*
+ * Put a node in the first free slot, without restoring order.
+ */
+static void heap_push_back(alarm_heap_t *heap, heap_node_t *node, uint64_t key)
+{
+    if (heap->count == heap->capacity)
+    {
+        heap->capacity = heap->capacity ? heap->capacity * 2 : HEAP_INITIAL;
+        heap->slots = realloc(heap->slots, heap->capacity * sizeof(heap_slot_t));
+        if (heap->slots == NULL)
+            errno_abort("Grow alarm heap");
+    }
+    heap->slots[heap->count].key = key;
+    heap->slots[heap->count].node = node;
+    node->index = heap->count++;
+}
+
+void heap_insert(alarm_heap_t *heap, heap_node_t *node, uint64_t key)
+{
+    heap_push_back(heap, node, key);
+    heap_sift_up(heap, node->index);
+}
+
+/*
+ * Add a node without restoring heap order; heap_heapify must run
+ * before the heap is used for anything else. Appending n nodes and
+ * heapifying once is O(n), where n inserts are O(n log n).
+ */
+void heap_append(alarm_heap_t *heap, heap_node_t *node, uint64_t key)
+{
+    heap_push_back(heap, node, key);
+}
+
+/*
+ * Restore heap order over the whole array, bottom-up (Floyd).
+ */
+void heap_heapify(alarm_heap_t *heap)
+{
+    size_t index;
+
+    if (heap->count < 2)
+        return;
+    for (index = (heap->count - 2) / HEAP_ARITY + 1; index-- > 0;)
+        heap_sift_down(heap, index);
+}
+
+/*
+ * Take a node out of the heap. The last slot fills the hole, and
+ * then moves whichever way its key requires.
+ */
+void heap_remove(alarm_heap_t *heap, heap_node_t *node)
+{
+    size_t index = node->index;
+
+    if (index == HEAP_NONE)
+        return;
+    node->index = HEAP_NONE;
+    if (index == --heap->count)
+        return;
+    heap_set(heap, index, heap->slots[heap->count]);
+    if (index > 0 && heap->slots[(index - 1) / HEAP_ARITY].key > heap->slots[index].key)
+        heap_sift_up(heap, index);
+    else
+        heap_sift_down(heap, index);
+}
+
+/*
+ * Give a queued node a new key, and restore heap order from its
+ * slot: up for an earlier key, down for a later one.
+ */
+void heap_update(alarm_heap_t *heap, heap_node_t *node, uint64_t key)
+{
+    uint64_t old = heap->slots[node->index].key;
+
+    heap->slots[node->index].key = key;
+    if (key < old)
+        heap_sift_up(heap, node->index);
+    else if (key > old)
+        heap_sift_down(heap, node->index);
+}
+
+heap_node_t *heap_pop(alarm_heap_t *heap)
+{
+    heap_node_t *node;
+
+    if (heap->count == 0)
+        return NULL;
+    node = heap_min(heap);
+    heap_remove(heap, node);
+    return node;
+}
@@ -0,0 +1,57 @@
+#ifndef __alarm_heap_h
+#define __alarm_heap_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An indexed 4-ary min-heap. The heap is one contiguous array of
+ * (key, node) pairs, so sifting compares keys without touching
+ * the nodes themselves, and each node records its own slot in
+ * the array. Knowing the slot lets a node be removed, or have its
+ * key raised or lowered, in O(log n) without searching for it.
+ */
+#define HEAP_ARITY 4
+#define HEAP_NONE ((size_t)-1) /* Index of a node that is not queued */
+
+/*
+ * The heap node is embedded in the caller's structure, and
+ * heap_entry() gets back to the enclosing structure.
+ */
+typedef struct heap_node_tag
+{
+    size_t index; /* Slot in the heap array, or HEAP_NONE */
+} heap_node_t;
+
+#define heap_entry(node, type, member) \
+    ((type *)((char *)(node) - offsetof(type, member)))
+
+typedef struct heap_slot_tag
+{
+    uint64_t key;
+    heap_node_t *node;
+} heap_slot_t;
+
+typedef struct alarm_heap_tag
+{
+    heap_slot_t *slots;
+    size_t count;
+    size_t capacity;
+} alarm_heap_t;
+
+void heap_init(alarm_heap_t *heap);
+void heap_insert(alarm_heap_t *heap, heap_node_t *node, uint64_t key);
+void heap_remove(alarm_heap_t *heap, heap_node_t *node);
+void heap_update(alarm_heap_t *heap, heap_node_t *node, uint64_t key);
+heap_node_t *heap_pop(alarm_heap_t *heap);
+void heap_append(alarm_heap_t *heap, heap_node_t *node, uint64_t key);
+void heap_heapify(alarm_heap_t *heap);
+
+/*
+ * The root is the node with the smallest key; it is only valid
+ * when heap->count is non-zero.
+ */
+#define heap_min_key(heap) ((heap)->slots[0].key)
+#define heap_min(heap) ((heap)->slots[0].node)
+
+#endif
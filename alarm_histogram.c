@@ -0,0 +1,101 @@
+/*
+ * alarm_histogram.c
+ *
+ * Registration and reading side of the per-thread histograms: see
+ * alarm_histogram.h. Histograms are never unregistered, so a
+ * reader can walk the list without a lock while threads come and
+ * go.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "errors.h"
+#include "alarm_histogram.h"
+
+/*
+ * The highest value that falls in bucket "index".
+ */
+static uint64_t bucket_limit(int index)
+{
+    int shift;
+
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return index;
+    shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    return (((uint64_t)(HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) + 1) << shift) - 1;
+}
+
+void histogram_set_init(histogram_set_t *set)
+{
+    pthread_mutex_init(&set->lock, NULL);
+    atomic_init(&set->first, NULL);
+}
+
+/*
+ * Give the calling thread a histogram of its own.
+ */
+histogram_t *histogram_register(histogram_set_t *set)
+{
+    histogram_t *histogram;
+
+    histogram = calloc(1, sizeof(*histogram));
+    if (histogram == NULL)
+        errno_abort("Allocate histogram");
+    pthread_mutex_lock(&set->lock);
+    histogram->next = atomic_load(&set->first);
+    atomic_store(&set->first, histogram);
+    pthread_mutex_unlock(&set->lock);
+    return histogram;
+}
+
+/*
+ * Add up every histogram in the set. Values recorded while the
+ * merge runs may or may not be included; "count" is read first,
+ * so it never exceeds the sum of the buckets.
+ */
+void histogram_merge(histogram_set_t *set, histogram_snapshot_t *snapshot)
+{
+    histogram_t *histogram;
+    uint64_t max;
+    int i;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    for (histogram = atomic_load(&set->first); histogram != NULL; histogram = histogram->next)
+    {
+        snapshot->count += atomic_load_explicit(&histogram->count, memory_order_relaxed);
+        snapshot->sum += atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+        max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+        if (max > snapshot->max)
+            snapshot->max = max;
+        for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+            snapshot->buckets[i] += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+    }
+}
+
+/*
+ * The value at or below which "fraction" of the values fall, as
+ * the upper end of its bucket but never above the largest value
+ * recorded. Returns 0 for an empty histogram.
+ */
+uint64_t histogram_percentile(const histogram_snapshot_t *snapshot, double fraction)
+{
+    uint64_t rank, seen = 0, limit;
+    int i;
+
+    if (snapshot->count == 0)
+        return 0;
+    rank = (uint64_t)(fraction * snapshot->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > snapshot->count)
+        rank = snapshot->count;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += snapshot->buckets[i];
+        if (seen >= rank)
+        {
+            limit = bucket_limit(i);
+            return limit < snapshot->max ? limit : snapshot->max;
+        }
+    }
+    return snapshot->max;
+}
@@ -0,0 +1,88 @@
+#ifndef __alarm_histogram_h
+#define __alarm_histogram_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Log-bucketed (HDR-style) histogram of nanosecond values. Every
+ * power of two is split into HISTOGRAM_SUB_BUCKETS linear buckets,
+ * so a recorded value is known to within 1/32 (about 3%) of itself
+ * from 1 ns up to the full 64-bit range, in a fixed 15 kB table.
+ *
+ * Each recording thread owns a histogram of its own, obtained from
+ * histogram_register, and is the only thread that writes it; the
+ * counters are atomic only so that a reader may look at them at
+ * any time. Recording is a count-leading-zeros, a shift and three
+ * relaxed load/store pairs: no lock, no read-modify-write, no
+ * shared cache line. Readers add up every registered histogram
+ * with histogram_merge.
+ */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct histogram_tag
+{
+    struct histogram_tag *next; /* Next registered histogram */
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+    atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+typedef struct histogram_set_tag
+{
+    pthread_mutex_t lock;       /* Serializes registration */
+    _Atomic(histogram_t *) first;
+} histogram_set_t;
+
+static inline int histogram_bucket(uint64_t value)
+{
+    int exponent;
+
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return (int)value;
+    exponent = 63 - __builtin_clzll(value);
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+           (int)((value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/*
+ * Add one value. Only the thread that registered "histogram" may
+ * call this.
+ */
+static inline void histogram_record(histogram_t *histogram, uint64_t value)
+{
+    atomic_uint_fast64_t *bucket = &histogram->buckets[histogram_bucket(value)];
+
+    atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&histogram->sum,
+                          atomic_load_explicit(&histogram->sum, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+    if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed))
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+    atomic_store_explicit(&histogram->count,
+                          atomic_load_explicit(&histogram->count, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+/*
+ * A merged copy, for reading.
+ */
+typedef struct histogram_snapshot_tag
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_snapshot_t;
+
+void histogram_set_init(histogram_set_t *set);
+histogram_t *histogram_register(histogram_set_t *set);
+void histogram_merge(histogram_set_t *set, histogram_snapshot_t *snapshot);
+uint64_t histogram_percentile(const histogram_snapshot_t *snapshot, double fraction);
+
+#endif
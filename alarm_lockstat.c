@@ -0,0 +1,256 @@
+/*
+ * alarm_lockstat.c
+ *
+ * Lock instrumentation: see alarm_lockstat.h. Call sites register
+ * themselves on their first acquisition, on a list that is only
+ * ever pushed to, so the report can walk it at any time. Each
+ * thread remembers the locks it holds, with the site and time of
+ * acquisition, in a short thread-local stack.
+ */
+#ifdef LOCK_STATS
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "errors.h"
+#include "alarm_lockstat.h"
+#include "alarm_time.h"
+
+#define LOCKSTAT_DEPTH 8 /* Locks one thread may hold at once */
+
+typedef struct held_tag
+{
+    const void *lock;
+    lock_site_t *site;
+    uint64_t since;
+} held_t;
+
+static _Atomic(lock_site_t *) sites;
+static _Thread_local held_t held[LOCKSTAT_DEPTH];
+static _Thread_local int held_count;
+
+static void site_register(lock_site_t *site)
+{
+    int expected = 0;
+
+    if (atomic_load_explicit(&site->registered, memory_order_acquire) ||
+        !atomic_compare_exchange_strong(&site->registered, &expected, 1))
+        return;
+    site->next = atomic_load(&sites);
+    while (!atomic_compare_exchange_weak(&sites, &site->next, site))
+        ;
+}
+
+/*
+ * Note that the calling thread now holds "lock", after waiting
+ * "wait" nanoseconds for it (0 for an uncontended acquisition).
+ */
+static void hold_begin(lock_site_t *site, const void *lock, int contended, uint64_t wait)
+{
+    site_register(site);
+    atomic_fetch_add_explicit(&site->acquired, 1, memory_order_relaxed);
+    if (contended)
+    {
+        atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&site->wait_ns, wait, memory_order_relaxed);
+    }
+    if (held_count < LOCKSTAT_DEPTH)
+    {
+        held[held_count].lock = lock;
+        held[held_count].site = site;
+        held[held_count].since = monotonic_ns();
+        held_count++;
+    }
+}
+
+/*
+ * Charge the hold of "lock" to the site that took it. A release of
+ * a lock this thread did not take (a semaphore posted by another
+ * thread) is not a hold, and is ignored.
+ */
+static void hold_end(const void *lock)
+{
+    uint64_t hold, max;
+    lock_site_t *site;
+    int i;
+
+    for (i = held_count - 1; i >= 0; i--)
+        if (held[i].lock == lock)
+            break;
+    if (i < 0)
+        return;
+    site = held[i].site;
+    hold = monotonic_ns() - held[i].since;
+    held[i] = held[--held_count];
+
+    atomic_fetch_add_explicit(&site->hold_ns, hold, memory_order_relaxed);
+    max = atomic_load_explicit(&site->max_hold_ns, memory_order_relaxed);
+    while (hold > max &&
+           !atomic_compare_exchange_weak_explicit(&site->max_hold_ns, &max, hold,
+                                                  memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+int lockstat_mutex_lock_at(lock_site_t *site, pthread_mutex_t *mutex)
+{
+    uint64_t start;
+    int status;
+
+    status = pthread_mutex_trylock(mutex);
+    if (status == 0)
+    {
+        hold_begin(site, mutex, 0, 0);
+        return 0;
+    }
+    if (status != EBUSY)
+        return status;
+    start = monotonic_ns();
+    status = pthread_mutex_lock(mutex);
+    if (status == 0)
+        hold_begin(site, mutex, 1, monotonic_ns() - start);
+    return status;
+}
+
+int lockstat_mutex_unlock_at(pthread_mutex_t *mutex)
+{
+    hold_end(mutex);
+    return pthread_mutex_unlock(mutex);
+}
+
+int lockstat_cond_wait_at(lock_site_t *site, pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    int status;
+
+    hold_end(mutex);
+    status = pthread_cond_wait(cond, mutex);
+    hold_begin(site, mutex, 0, 0);
+    return status;
+}
+
+int lockstat_cond_timedwait_at(lock_site_t *site, pthread_cond_t *cond, pthread_mutex_t *mutex,
+                               const struct timespec *abstime)
+{
+    int status;
+
+    hold_end(mutex);
+    status = pthread_cond_timedwait(cond, mutex, abstime);
+    hold_begin(site, mutex, 0, 0);
+    return status;
+}
+
+int lockstat_sem_wait_at(lock_site_t *site, sem_t *sem)
+{
+    uint64_t start;
+    int status;
+
+    if (sem_trywait(sem) == 0)
+    {
+        hold_begin(site, sem, 0, 0);
+        return 0;
+    }
+    if (errno != EAGAIN)
+        return -1;
+    start = monotonic_ns();
+    while ((status = sem_wait(sem)) == -1 && errno == EINTR)
+        ;
+    if (status == 0)
+        hold_begin(site, sem, 1, monotonic_ns() - start);
+    return status;
+}
+
+int lockstat_sem_post_at(sem_t *sem)
+{
+    hold_end(sem);
+    return sem_post(sem);
+}
+
+static int compare_sites(const void *a, const void *b)
+{
+    unsigned long long x = atomic_load(&(*(lock_site_t *const *)a)->hold_ns);
+    unsigned long long y = atomic_load(&(*(lock_site_t *const *)b)->hold_ns);
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * Print one line per call site, the longest total hold first.
+ */
+void lockstat_report(FILE *out)
+{
+    lock_site_t *site, **sorted;
+    char where[64];
+    size_t count = 0, i;
+
+    for (site = atomic_load(&sites); site != NULL; site = site->next)
+        count++;
+    sorted = malloc((count + 1) * sizeof(*sorted));
+    if (sorted == NULL)
+        return;
+    count = 0;
+    for (site = atomic_load(&sites); site != NULL; site = site->next)
+        sorted[count++] = site;
+    qsort(sorted, count, sizeof(*sorted), compare_sites);
+
+    fprintf(out, "%-16s %-28s %10s %10s %12s %12s %12s\n", "lock", "site", "acquired",
+            "contended", "wait ms", "hold ms", "max hold ms");
+    for (i = 0; i < count; i++)
+    {
+        site = sorted[i];
+        snprintf(where, sizeof(where), "%s:%d", site->function, site->line);
+        fprintf(out, "%-16s %-28s %10llu %10llu %12.3f %12.3f %12.3f\n", site->lock, where,
+                atomic_load(&site->acquired), atomic_load(&site->contended),
+                atomic_load(&site->wait_ns) / 1e6, atomic_load(&site->hold_ns) / 1e6,
+                atomic_load(&site->max_hold_ns) / 1e6);
+    }
+    fflush(out);
+    free(sorted);
+}
+
+static void report_at_exit(void)
+{
+    lockstat_report(stderr);
+}
+
+/*
+ * Print the table whenever SIGUSR2 arrives. The signal is blocked
+ * in every other thread, so it is always taken here, outside any
+ * lock.
+ */
+static void *report_thread(void *arg)
+{
+    sigset_t *signals = arg;
+    int signal;
+
+    while (1)
+        if (sigwait(signals, &signal) == 0)
+            lockstat_report(stderr);
+    return NULL;
+}
+
+void lockstat_init(void)
+{
+    static sigset_t signals;
+    sigset_t all, old;
+    pthread_t thread;
+    int status;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+    status = pthread_sigmask(SIG_BLOCK, &signals, &old);
+    if (status != 0)
+        err_abort(status, "Block lock report signal");
+
+    // The reporter must not take any other signal the program handles itself
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, NULL);
+    status = pthread_create(&thread, NULL, report_thread, &signals);
+    if (status != 0)
+        err_abort(status, "Create lock report thread");
+    pthread_detach(thread);
+    sigaddset(&old, SIGUSR2);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    atexit(report_at_exit);
+}
+
+#endif
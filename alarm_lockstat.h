@@ -0,0 +1,77 @@
+#ifndef __alarm_lockstat_h
+#define __alarm_lockstat_h
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+
+/*
+ * Lock instrumentation, enabled at build time with -DLOCK_STATS
+ * ("make lockstats"). The programs take and release their alarm
+ * list locks through the macros below; without LOCK_STATS they are
+ * the plain pthread and semaphore calls, and cost nothing.
+ *
+ * With LOCK_STATS every call site that takes a lock keeps its own
+ * counters: acquisitions, acquisitions that had to wait, total wait
+ * time, and total and longest hold time. A hold is charged to the
+ * site that took the lock, however it is released. A condition wait
+ * ends the hold, and the wakeup starts a new one at the wait's call
+ * site; the time asleep counts as neither wait nor hold.
+ *
+ * lockstat_init (call it before creating any thread) prints the
+ * table to stderr at exit and every time the process gets SIGUSR2.
+ */
+#ifdef LOCK_STATS
+
+#include <stdatomic.h>
+
+typedef struct lock_site_tag
+{
+    const char *lock;       /* The lock expression, as written */
+    const char *function;
+    int line;
+    atomic_int registered;
+    struct lock_site_tag *next;
+    atomic_ullong acquired;
+    atomic_ullong contended;
+    atomic_ullong wait_ns;
+    atomic_ullong hold_ns;
+    atomic_ullong max_hold_ns;
+} lock_site_t;
+
+#define LOCK_SITE(lock) \
+    ({ static lock_site_t site_ = {#lock, __func__, __LINE__}; &site_; })
+
+int lockstat_mutex_lock_at(lock_site_t *site, pthread_mutex_t *mutex);
+int lockstat_mutex_unlock_at(pthread_mutex_t *mutex);
+int lockstat_cond_wait_at(lock_site_t *site, pthread_cond_t *cond, pthread_mutex_t *mutex);
+int lockstat_cond_timedwait_at(lock_site_t *site, pthread_cond_t *cond, pthread_mutex_t *mutex,
+                               const struct timespec *abstime);
+int lockstat_sem_wait_at(lock_site_t *site, sem_t *sem);
+int lockstat_sem_post_at(sem_t *sem);
+void lockstat_init(void);
+void lockstat_report(FILE *out);
+
+#define lockstat_mutex_lock(mutex) lockstat_mutex_lock_at(LOCK_SITE(mutex), (mutex))
+#define lockstat_mutex_unlock(mutex) lockstat_mutex_unlock_at(mutex)
+#define lockstat_cond_wait(cond, mutex) lockstat_cond_wait_at(LOCK_SITE(mutex), (cond), (mutex))
+#define lockstat_cond_timedwait(cond, mutex, abstime) \
+    lockstat_cond_timedwait_at(LOCK_SITE(mutex), (cond), (mutex), (abstime))
+#define lockstat_sem_wait(sem) lockstat_sem_wait_at(LOCK_SITE(sem), (sem))
+#define lockstat_sem_post(sem) lockstat_sem_post_at(sem)
+
+#else
+
+#define lockstat_mutex_lock(mutex) pthread_mutex_lock(mutex)
+#define lockstat_mutex_unlock(mutex) pthread_mutex_unlock(mutex)
+#define lockstat_cond_wait(cond, mutex) pthread_cond_wait((cond), (mutex))
+#define lockstat_cond_timedwait(cond, mutex, abstime) \
+    pthread_cond_timedwait((cond), (mutex), (abstime))
+#define lockstat_sem_wait(sem) sem_wait(sem)
+#define lockstat_sem_post(sem) sem_post(sem)
+#define lockstat_init() ((void)0)
+#define lockstat_report(out) ((void)0)
+
+#endif
+
+#endif
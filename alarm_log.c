@@ -0,0 +1,253 @@
+/*
+ * alarm_log.c
+ *
+ * The event log: see alarm_log.h. The ring is a bounded queue in
+ * which every cell carries a sequence number. A producer claims a
+ * position with a compare-and-swap on "head", copies its record
+ * into the cell, and then publishes it by advancing the cell's
+ * sequence; the writer consumes cells in position order as their
+ * sequence numbers say they are ready. Producers only wake the
+ * writer when it has gone to sleep on an empty ring.
+ */
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "errors.h"
+#include "alarm_log.h"
+
+typedef struct log_cell_tag
+{
+    atomic_size_t sequence;
+    log_record_t record;
+} log_cell_t;
+
+static log_cell_t log_ring[LOG_RING];
+static atomic_size_t log_head;     /* Next position a producer claims */
+static size_t log_tail;            /* Next position the writer reads */
+static atomic_size_t log_written;  /* Records the writer has written */
+static atomic_int log_sleeping;    /* The writer waits on log_wake */
+static sem_t log_wake;
+static log_format_t log_format;
+
+/*
+ * Write out a batch, carrying on after short writes.
+ */
+static void log_write(int fd, struct iovec *iov, int count)
+{
+    ssize_t bytes;
+
+    while (count > 0)
+    {
+        bytes = writev(fd, iov, count);
+        if (bytes == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return; // Nowhere to report it; drop the batch
+        }
+        while (count > 0 && (size_t)bytes >= iov->iov_len)
+        {
+            bytes -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + bytes;
+            iov->iov_len -= bytes;
+        }
+    }
+}
+
+/*
+ * Return 1 if the cell at the writer's position holds a record.
+ */
+static int log_ready(void)
+{
+    log_cell_t *cell = &log_ring[log_tail & (LOG_RING - 1)];
+
+    return atomic_load_explicit(&cell->sequence, memory_order_acquire) == log_tail + 1;
+}
+
+static void *log_writer(void *arg)
+{
+    static char lines[LOG_BATCH][LOG_LINE];
+    struct iovec iov[LOG_BATCH];
+    int count, fd, batch_fd = 1;
+    size_t length;
+
+    while (1)
+    {
+        count = 0;
+        while (count < LOG_BATCH && log_ready())
+        {
+            log_cell_t *cell = &log_ring[log_tail & (LOG_RING - 1)];
+
+            fd = 1;
+            length = log_format(&cell->record, lines[count], LOG_LINE, &fd);
+            if (length >= LOG_LINE)
+                length = LOG_LINE - 1;
+            atomic_store_explicit(&cell->sequence, log_tail + LOG_RING, memory_order_release);
+            log_tail++;
+
+            // A batch goes to one descriptor
+            if (count > 0 && fd != batch_fd)
+            {
+                log_write(batch_fd, iov, count);
+                atomic_fetch_add(&log_written, count);
+                memcpy(lines[0], lines[count], length);
+                count = 0;
+            }
+            batch_fd = fd;
+            iov[count].iov_base = lines[count];
+            iov[count].iov_len = length;
+            count++;
+        }
+        if (count > 0)
+        {
+            log_write(batch_fd, iov, count);
+            atomic_fetch_add(&log_written, count);
+            continue;
+        }
+
+        /*
+         * The ring looks empty. Say so before looking again, so a
+         * producer that publishes after the second look is sure to
+         * see the flag and post the semaphore.
+         */
+        atomic_store(&log_sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (log_ready())
+        {
+            atomic_store(&log_sleeping, 0);
+            continue;
+        }
+        while (sem_wait(&log_wake) == -1)
+            if (errno != EINTR)
+                errno_abort("Wait for log records");
+    }
+    return NULL;
+}
+
+void log_init(log_format_t format)
+{
+    pthread_t thread;
+    size_t i;
+    int status;
+
+    for (i = 0; i < LOG_RING; i++)
+        atomic_init(&log_ring[i].sequence, i);
+    log_format = format;
+    if (sem_init(&log_wake, 0, 0) == -1)
+        errno_abort("Init log semaphore");
+    status = pthread_create(&thread, NULL, log_writer, NULL);
+    if (status != 0)
+        err_abort(status, "Create log writer");
+    pthread_detach(thread);
+}
+
+/*
+ * Claim the next cell of the ring, waiting for room if it is full.
+ */
+static log_cell_t *log_claim(size_t *claimed)
+{
+    size_t position = atomic_load_explicit(&log_head, memory_order_relaxed);
+    log_cell_t *cell;
+    intptr_t lag;
+
+    while (1)
+    {
+        cell = &log_ring[position & (LOG_RING - 1)];
+        lag = (intptr_t)(atomic_load_explicit(&cell->sequence, memory_order_acquire) - position);
+        if (lag == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&log_head, &position, position + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        }
+        else if (lag < 0)
+        {
+            // The ring is full: let the writer catch up
+            sched_yield();
+            position = atomic_load_explicit(&log_head, memory_order_relaxed);
+        }
+        else
+            position = atomic_load_explicit(&log_head, memory_order_relaxed);
+    }
+    *claimed = position;
+    return cell;
+}
+
+/*
+ * Hand a filled-in cell to the writer.
+ */
+static void log_publish(log_cell_t *cell, size_t position)
+{
+    atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+
+    // Pairs with the writer setting log_sleeping before its last look
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&log_sleeping, memory_order_relaxed) &&
+        atomic_exchange(&log_sleeping, 0))
+        sem_post(&log_wake);
+}
+
+/*
+ * Queue a record. "message" may be NULL.
+ */
+void log_event(int event, pthread_t thread, int alarm_id, int group_id,
+               const char *message)
+{
+    size_t position;
+    log_cell_t *cell = log_claim(&position);
+
+    cell->record.event = event;
+    cell->record.alarm_id = alarm_id;
+    cell->record.group_id = group_id;
+    cell->record.thread = thread;
+    cell->record.at = time(NULL);
+    if (message != NULL)
+    {
+        strncpy(cell->record.message, message, LOG_TEXT - 1);
+        cell->record.message[LOG_TEXT - 1] = '\0';
+    }
+    else
+        cell->record.message[0] = '\0';
+    log_publish(cell, position);
+}
+
+/*
+ * Queue a record of "count" numbers, at most LOG_VALUES; the rest
+ * of its values are zero.
+ */
+void log_values(int event, pthread_t thread, const uint64_t *values, size_t count)
+{
+    size_t position;
+    log_cell_t *cell = log_claim(&position);
+
+    if (count > LOG_VALUES)
+        count = LOG_VALUES;
+    cell->record.event = event;
+    cell->record.alarm_id = 0;
+    cell->record.group_id = 0;
+    cell->record.thread = thread;
+    cell->record.at = time(NULL);
+    memcpy(cell->record.values, values, count * sizeof(*values));
+    memset(cell->record.values + count, 0, (LOG_VALUES - count) * sizeof(*values));
+    log_publish(cell, position);
+}
+
+/*
+ * Wait until every record queued before the call has been written.
+ */
+void log_drain(void)
+{
+    size_t target = atomic_load(&log_head);
+    struct timespec pause = {0, 1000000};
+
+    while (atomic_load(&log_written) < target)
+        nanosleep(&pause, NULL);
+}
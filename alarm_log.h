@@ -0,0 +1,58 @@
+#ifndef __alarm_log_h
+#define __alarm_log_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Asynchronous event log. A thread that has something to report
+ * copies a small binary record into a lock-free ring and carries
+ * on; one writer thread turns the records into text with the
+ * program's format function and writes them out in batches with
+ * writev. So no thread that holds an alarm structure lock ever
+ * waits for stdio or for the terminal, and output from different
+ * threads is never interleaved within a line.
+ *
+ * When the ring is full, log_event waits for the writer to make
+ * room rather than dropping records.
+ *
+ * A record carries either a message (log_event) or, for a report
+ * made of numbers, up to LOG_VALUES of them (log_values); the
+ * format function knows from the event which it is.
+ */
+#define LOG_RING 8192  /* Records in the ring, a power of 2 */
+#define LOG_BATCH 64   /* Records per writev */
+#define LOG_LINE 320   /* Longest formatted record */
+#define LOG_TEXT 129   /* Message bytes kept per record */
+#define LOG_VALUES (LOG_TEXT / sizeof(uint64_t)) /* Numbers a record can carry instead */
+
+typedef struct log_record_tag
+{
+    int event;     /* Meaning is up to the format function */
+    int alarm_id;
+    int group_id;
+    pthread_t thread;
+    time_t at;     /* Wall clock time of the event */
+    union
+    {
+        char message[LOG_TEXT];
+        uint64_t values[LOG_VALUES];
+    };
+} log_record_t;
+
+/*
+ * Format "record" into "buf" and return its length; set "*fd" if
+ * the line should not go to standard output.
+ */
+typedef size_t (*log_format_t)(const log_record_t *record, char *buf,
+                               size_t size, int *fd);
+
+void log_init(log_format_t format);
+void log_event(int event, pthread_t thread, int alarm_id, int group_id,
+               const char *message);
+void log_values(int event, pthread_t thread, const uint64_t *values, size_t count);
+void log_drain(void);
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * alarm_parse.c
+ *
+ * Hand-written command parser: see alarm_parse.h. Whitespace is
+ * allowed wherever the sscanf formats allowed it, a message longer
+ * than COMMAND_MESSAGE_MAX bytes is cut short, and a timeout is
+ * handed to parse_timeout.
+ */
+#include <limits.h>
+#include <string.h>
+#include "alarm_parse.h"
+#include "alarm_time.h"
+
+#define TIMEOUT_TEXT_MAX 31
+
+typedef struct cursor_tag
+{
+    const char *next;
+    const char *end;
+} cursor_t;
+
+static int is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static void skip_space(cursor_t *cursor)
+{
+    while (cursor->next < cursor->end && is_space(*cursor->next))
+        cursor->next++;
+}
+
+/*
+ * Match "text" exactly. Returns 0 on success.
+ */
+static int expect(cursor_t *cursor, const char *text)
+{
+    size_t length = strlen(text);
+
+    if ((size_t)(cursor->end - cursor->next) < length ||
+        memcmp(cursor->next, text, length) != 0)
+        return -1;
+    cursor->next += length;
+    return 0;
+}
+
+/*
+ * Read a decimal int, after optional whitespace and sign, as "%d"
+ * would. Returns 0 on success.
+ */
+static int parse_int(cursor_t *cursor, int *value)
+{
+    long long result = 0;
+    int negative = 0, digits = 0;
+
+    skip_space(cursor);
+    if (cursor->next < cursor->end && (*cursor->next == '-' || *cursor->next == '+'))
+        negative = *cursor->next++ == '-';
+    while (cursor->next < cursor->end && *cursor->next >= '0' && *cursor->next <= '9')
+    {
+        result = result * 10 + (*cursor->next++ - '0');
+        if (result > (long long)INT_MAX + 1)
+            return -1;
+        digits++;
+    }
+    if (digits == 0 || (!negative && result > INT_MAX))
+        return -1;
+    *value = (int)(negative ? -result : result);
+    return 0;
+}
+
+/*
+ * Parse one command line; "length" does not include a newline.
+ * Sets command->type to the command the line names, even when the
+ * rest of it is malformed, and returns 0 if the whole command is
+ * valid or -1 if it is not.
+ */
+int parse_command(const char *line, size_t length, command_t *command)
+{
+    cursor_t cursor = {line, line + length};
+    char timeout[TIMEOUT_TEXT_MAX + 1];
+    const char *start;
+    size_t size;
+
+    command->type = COMMAND_NONE;
+    if (expect(&cursor, "Start_Alarm") == 0)
+        command->type = COMMAND_START;
+    else if (expect(&cursor, "Start_Periodic_Alarm") == 0)
+        command->type = COMMAND_PERIODIC;
+    else if (expect(&cursor, "Change_Alarm") == 0)
+        command->type = COMMAND_CHANGE;
+    else if (expect(&cursor, "Cancel_Alarm") == 0)
+    {
+        command->type = COMMAND_CANCEL;
+        if (expect(&cursor, "(") != 0 || parse_int(&cursor, &command->alarm_id) != 0 ||
+            expect(&cursor, ")") != 0)
+            return -1;
+        skip_space(&cursor);
+        return cursor.next == cursor.end ? 0 : -1;
+    }
+    else if (expect(&cursor, "Stats") == 0)
+    {
+        command->type = COMMAND_STATS;
+        skip_space(&cursor);
+        return cursor.next == cursor.end ? 0 : -1;
+    }
+    else
+        return -1;
+
+    if (expect(&cursor, "(") != 0 || parse_int(&cursor, &command->alarm_id) != 0 ||
+        expect(&cursor, "):") != 0)
+        return -1;
+    skip_space(&cursor);
+    if (expect(&cursor, "Group(") != 0 || parse_int(&cursor, &command->group_id) != 0 ||
+        expect(&cursor, ")") != 0)
+        return -1;
+
+    skip_space(&cursor);
+    start = cursor.next;
+    while (cursor.next < cursor.end && !is_space(*cursor.next))
+        cursor.next++;
+    size = cursor.next - start;
+    if (size == 0 || size > TIMEOUT_TEXT_MAX)
+        return -1;
+    memcpy(timeout, start, size);
+    timeout[size] = '\0';
+    if (parse_timeout(timeout, &command->timeout) != 0 ||
+        (command->type == COMMAND_PERIODIC && command->timeout == 0))
+        return -1;
+
+    // The message is the rest of the line, and may not be empty
+    skip_space(&cursor);
+    size = cursor.end - cursor.next;
+    if (size == 0)
+        return -1;
+    if (size > COMMAND_MESSAGE_MAX)
+        size = COMMAND_MESSAGE_MAX;
+    memcpy(command->message, cursor.next, size);
+    command->message[size] = '\0';
+    return 0;
+}
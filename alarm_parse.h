@@ -0,0 +1,40 @@
+#ifndef __alarm_parse_h
+#define __alarm_parse_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Parser for the alarm commands:
+ *
+ *   Start_Alarm(<id>): Group(<group>) <timeout> <message>
+ *   Start_Periodic_Alarm(<id>): Group(<group>) <period> <message>
+ *   Change_Alarm(<id>): Group(<group>) <timeout> <message>
+ *   Cancel_Alarm(<id>)
+ *   Stats
+ *
+ * It accepts what the original sscanf formats accepted, and works
+ * on a line that is not NUL-terminated, such as one inside a block
+ * of input that was read or mapped in one piece.
+ */
+#define COMMAND_NONE 0 /* Not a command the parser knows */
+#define COMMAND_START 1
+#define COMMAND_CHANGE 2
+#define COMMAND_STATS 3  /* No arguments */
+#define COMMAND_CANCEL 4 /* Only alarm_id */
+#define COMMAND_PERIODIC 5 /* The timeout is the period, and is never 0 */
+
+#define COMMAND_MESSAGE_MAX 128
+
+typedef struct command_tag
+{
+    int type;
+    int alarm_id;
+    int group_id;
+    uint64_t timeout; /* Nanoseconds */
+    char message[COMMAND_MESSAGE_MAX + 1];
+} command_t;
+
+int parse_command(const char *line, size_t length, command_t *command);
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * alarm_pool.c
+ *
+ * Work-stealing worker pool: see alarm_pool.h.
+ */
+#include <errno.h>
+#include <unistd.h>
+#include "errors.h"
+#include "alarm_pool.h"
+#include "alarm_time.h"
+
+static void pool_wake(pool_worker_t *worker)
+{
+    sem_post(&worker->wake);
+}
+
+/*
+ * Queue a job on a worker's inbox, and wake the worker only if the
+ * inbox was empty; otherwise a wake is already on its way.
+ */
+static void pool_hand(pool_worker_t *worker, pool_job_t *job)
+{
+    if (queue_push(&worker->inbox, &job->link))
+        pool_wake(worker);
+}
+
+/*
+ * Take a runnable job from some other worker, starting with the
+ * one after "worker". Returns NULL if every deque looks empty.
+ */
+static pool_job_t *pool_steal(pool_worker_t *worker)
+{
+    pool_t *pool = worker->pool;
+    void *item;
+    int i, victim, retry;
+
+    do
+    {
+        retry = 0;
+        for (i = 1; i < pool->count; i++)
+        {
+            victim = (worker->index + i) % pool->count;
+            item = deque_steal(&pool->workers[victim].deque);
+            if (item == DEQUE_ABORT)
+                retry = 1;
+            else if (item != DEQUE_EMPTY)
+                return item;
+        }
+    } while (retry);
+    return NULL;
+}
+
+/*
+ * Put a job on the wheel until "when" (CLOCK_MONOTONIC ns, rounded
+ * up to a tick), and wake the timer thread if it is waiting for a
+ * later tick.
+ */
+static void pool_park(pool_t *pool, pool_job_t *job, uint64_t when)
+{
+    pthread_mutex_lock(&pool->timer_mutex);
+    job->timer.expires = (when + pool->tick - 1) / pool->tick;
+    wheel_insert(&pool->wheel, &job->timer);
+    if (pool->timer_next == 0 || job->timer.expires < pool->timer_next)
+    {
+        pool->timer_next = job->timer.expires;
+        pthread_cond_signal(&pool->timer_cond);
+    }
+    pthread_mutex_unlock(&pool->timer_mutex);
+}
+
+/*
+ * The timer thread: sleep until the next tick with work, and deal
+ * out every job that is due, in one batch.
+ */
+static void *pool_timer(void *arg)
+{
+    pool_t *pool = arg;
+    wheel_node_t *expired, *next;
+    struct timespec until;
+    uint64_t tick;
+    unsigned int worker;
+    int status;
+
+    pthread_mutex_lock(&pool->timer_mutex);
+    while (1)
+    {
+        expired = wheel_advance(&pool->wheel, monotonic_ns() / pool->tick);
+        if (expired != NULL)
+        {
+            pthread_mutex_unlock(&pool->timer_mutex);
+            worker = atomic_fetch_add(&pool->next, 1);
+            for (; expired != NULL; expired = next)
+            {
+                next = expired->next;
+                pool_hand(&pool->workers[worker++ % pool->count],
+                          wheel_entry(expired, pool_job_t, timer));
+            }
+            pthread_mutex_lock(&pool->timer_mutex);
+            continue;
+        }
+
+        if (!wheel_next_tick(&pool->wheel, &tick))
+        {
+            pool->timer_next = 0;
+            status = pthread_cond_wait(&pool->timer_cond, &pool->timer_mutex);
+            if (status != 0)
+                err_abort(status, "Wait for pool timer");
+            continue;
+        }
+        until = ns_to_timespec(tick * pool->tick);
+        pool->timer_next = tick;
+        while (pool->timer_next == tick)
+        {
+            status = pthread_cond_timedwait(&pool->timer_cond, &pool->timer_mutex, &until);
+            if (status == ETIMEDOUT)
+                break;
+            if (status != 0)
+                err_abort(status, "Wait for pool timer");
+        }
+    }
+    return NULL;
+}
+
+static void *pool_worker(void *arg)
+{
+    pool_worker_t *worker = arg;
+    pool_t *pool = worker->pool;
+    queue_node_t *node, *next;
+    pool_job_t *job;
+    uint64_t again;
+    int moved;
+
+    while (1)
+    {
+        moved = 0;
+        for (node = queue_take(&worker->inbox); node != NULL; node = next)
+        {
+            next = node->next;
+            deque_push(&worker->deque, queue_entry(node, pool_job_t, link));
+            moved++;
+        }
+
+        // More than one job at once: let a sleeping peer steal some
+        if (moved > 1 && pool->count > 1)
+            pool_wake(&pool->workers[(worker->index + 1) % pool->count]);
+
+        job = deque_take(&worker->deque);
+        if (job == NULL)
+            job = pool_steal(worker);
+        if (job != NULL)
+        {
+            again = job->run(job);
+            if (again != 0 && pool->tick == 0)
+                err_abort(EINVAL, "Run a job again in a pool without a timer");
+            if (again != 0)
+                pool_park(pool, job, again);
+            continue;
+        }
+
+        // Nothing runnable: sleep until new work arrives
+        if (sem_wait(&worker->wake) == -1 && errno != EINTR)
+            errno_abort("Wait for pool work");
+    }
+    return NULL;
+}
+
+/*
+ * Start "workers" threads (0 means one per online CPU) and the
+ * timer thread, with wheel ticks of "tick" nanoseconds. A "tick" of
+ * 0 starts no timer thread, for a pool whose jobs always finish.
+ */
+void pool_init(pool_t *pool, int workers, uint64_t tick)
+{
+    pthread_condattr_t cond_attr;
+    pool_worker_t *worker;
+    int i, status;
+
+    if (workers <= 0)
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 1)
+        workers = 1;
+    if (workers > POOL_WORKERS_MAX)
+        workers = POOL_WORKERS_MAX;
+    pool->count = workers;
+    pool->tick = tick;
+    atomic_init(&pool->next, 0);
+    for (i = 0; i < workers; i++)
+    {
+        worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        deque_init(&worker->deque);
+        queue_init(&worker->inbox);
+        sem_init(&worker->wake, 0, 0);
+    }
+
+    for (i = 0; i < workers; i++)
+    {
+        status = pthread_create(&pool->workers[i].thread, NULL, pool_worker, &pool->workers[i]);
+        if (status != 0)
+            err_abort(status, "Create pool worker");
+    }
+    if (tick == 0)
+        return;
+
+    // The timer's waits are measured on CLOCK_MONOTONIC, the same clock as the wheel
+    pthread_mutex_init(&pool->timer_mutex, NULL);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->timer_cond, &cond_attr);
+    wheel_init(&pool->wheel, monotonic_ns() / pool->tick);
+    pool->timer_next = 0;
+    status = pthread_create(&pool->timer_thread, NULL, pool_timer, pool);
+    if (status != 0)
+        err_abort(status, "Create pool timer");
+}
+
+/*
+ * Hand a job to the pool, from any thread. It runs as soon as a
+ * worker gets to it.
+ */
+void pool_submit(pool_t *pool, pool_job_t *job)
+{
+    pool_hand(&pool->workers[atomic_fetch_add(&pool->next, 1) % pool->count], job);
+}
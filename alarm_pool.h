@@ -0,0 +1,85 @@
+#ifndef __alarm_pool_h
+#define __alarm_pool_h
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include "alarm_deque.h"
+#include "alarm_queue.h"
+#include "alarm_wheel.h"
+
+/*
+ * A fixed pool of worker threads, one per online CPU unless told
+ * otherwise, that run jobs. Each worker owns a work-stealing deque
+ * of runnable jobs and runs from it LIFO; a worker with nothing to
+ * do steals the oldest job of another worker before it sleeps, so
+ * a burst of jobs that lands on one worker spreads over the pool.
+ *
+ * Other threads hand jobs in through each worker's lock-free inbox
+ * (round robin), since only a deque's owner may push to it.
+ *
+ * A job that asks to run again later is parked on the pool's one
+ * timing wheel, whose ticks are "tick" nanoseconds long. The pool's
+ * timer thread sleeps until the next tick that has work, takes
+ * every job due by then in one batch, and deals the batch out to
+ * the workers' inboxes, waking each worker at most once. So jobs
+ * due within the same tick, however many, cost one timer wakeup,
+ * and no worker sleeps on a timer of its own. A pool made with a
+ * tick of 0 has no wheel and no timer thread, and its jobs must
+ * never ask to run again.
+ */
+#define POOL_WORKERS_MAX 64
+
+struct pool_job_tag;
+
+/*
+ * Run a job. Returns the CLOCK_MONOTONIC time at which to run it
+ * again, or 0 if the job is finished; a finished job belongs to the
+ * run function, which may free it.
+ */
+typedef uint64_t (*pool_run_t)(struct pool_job_tag *job);
+
+/*
+ * The job is embedded in the caller's structure, and pool_entry()
+ * gets back to the enclosing structure.
+ */
+typedef struct pool_job_tag
+{
+    queue_node_t link;    /* In a worker's inbox */
+    wheel_node_t timer;   /* In the pool's wheel, while parked */
+    pool_run_t run;
+} pool_job_t;
+
+#define pool_entry(job, type, member) \
+    ((type *)((char *)(job) - offsetof(type, member)))
+
+struct pool_tag;
+
+typedef struct pool_worker_tag
+{
+    struct pool_tag *pool;
+    int index;
+    pthread_t thread;
+    work_deque_t deque;   /* Runnable jobs */
+    alarm_queue_t inbox;  /* Jobs handed in by other threads */
+    sem_t wake;
+} pool_worker_t;
+
+typedef struct pool_tag
+{
+    int count;
+    atomic_uint next;     /* Worker the next submitted job goes to */
+    pool_worker_t workers[POOL_WORKERS_MAX];
+    uint64_t tick;        /* Nanoseconds per wheel tick, 0 for no timer */
+    pthread_t timer_thread;
+    pthread_mutex_t timer_mutex; /* Protects the wheel and timer_next */
+    pthread_cond_t timer_cond;
+    alarm_wheel_t wheel;  /* Parked jobs */
+    uint64_t timer_next;  /* Tick the timer thread waits for, 0 if none */
+} pool_t;
+
+void pool_init(pool_t *pool, int workers, uint64_t tick);
+void pool_submit(pool_t *pool, pool_job_t *job);
+
+#endif
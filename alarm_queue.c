@@ -0,0 +1,66 @@
+/*
+ * alarm_queue.c
+ *
+ * Submission queue between the input threads and the alarm
+ * monitor: see alarm_queue.h.
+ */
+#include "alarm_queue.h"
+
+void queue_init(alarm_queue_t *queue)
+{
+    atomic_init(&queue->head, NULL);
+}
+
+/*
+ * Push a node. Returns 1 if the queue was empty, in which case the
+ * caller has to wake the consumer; a consumer that has not taken
+ * the earlier nodes yet is already due to see this one.
+ */
+int queue_push(alarm_queue_t *queue, queue_node_t *node)
+{
+    queue_node_t *head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    do
+        node->next = head;
+    while (!atomic_compare_exchange_weak_explicit(&queue->head, &head, node,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+    return head == NULL;
+}
+
+/*
+ * Push a chain of nodes with one compare-and-swap, so that they
+ * reach the consumer together. The chain runs from "newest" to
+ * "oldest" through "next", the way queue_push would have left it;
+ * "oldest" is the one the consumer sees first. Returns 1 if the
+ * queue was empty, like queue_push.
+ */
+int queue_push_chain(alarm_queue_t *queue, queue_node_t *newest, queue_node_t *oldest)
+{
+    queue_node_t *head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    do
+        oldest->next = head;
+    while (!atomic_compare_exchange_weak_explicit(&queue->head, &head, newest,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+    return head == NULL;
+}
+
+/*
+ * Take every queued node, oldest first, linked through "next".
+ * Only one thread may call this.
+ */
+queue_node_t *queue_take(alarm_queue_t *queue)
+{
+    queue_node_t *node, *next, *oldest = NULL;
+
+    node = atomic_exchange_explicit(&queue->head, NULL, memory_order_acquire);
+    for (; node != NULL; node = next)
+    {
+        next = node->next;
+        node->next = oldest;
+        oldest = node;
+    }
+    return oldest;
+}
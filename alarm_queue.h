@@ -0,0 +1,34 @@
+#ifndef __alarm_queue_h
+#define __alarm_queue_h
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+ * A lock-free multi-producer, single-consumer queue. Producers
+ * push one node at a time with a compare-and-swap; the consumer
+ * takes everything queued so far with a single exchange, and gets
+ * it back in the order it was pushed. Since the consumer never
+ * removes a single node from the shared list, there is no ABA
+ * problem. Nodes are embedded in the caller's structure, and
+ * queue_entry() gets back to the enclosing structure.
+ */
+typedef struct queue_node_tag
+{
+    struct queue_node_tag *next;
+} queue_node_t;
+
+#define queue_entry(node, type, member) \
+    ((type *)((char *)(node) - offsetof(type, member)))
+
+typedef struct alarm_queue_tag
+{
+    _Atomic(queue_node_t *) head; /* Most recently pushed node */
+} alarm_queue_t;
+
+void queue_init(alarm_queue_t *queue);
+int queue_push(alarm_queue_t *queue, queue_node_t *node);
+int queue_push_chain(alarm_queue_t *queue, queue_node_t *newest, queue_node_t *oldest);
+queue_node_t *queue_take(alarm_queue_t *queue);
+
+#endif
@@ -0,0 +1,464 @@
+/*
+ * alarm_server.c
+ *
+ * Unix domain socket front end: see alarm_server.h.
+ */
+#define _GNU_SOURCE // accept4
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "errors.h"
+#include "alarm_server.h"
+
+struct server_ticket_tag
+{
+    queue_node_t link;           /* On answered, once handed back */
+    struct server_ticket_tag *next; /* The client's next reply */
+    server_client_t *client;
+    int done;                    /* Filled in and handed back; server thread only */
+    char text[SERVER_REPLY];
+};
+
+struct server_client_tag
+{
+    int fd;                /* -1 once closed, while tickets are still out */
+    int events;            /* What epoll is watching for */
+    int closing;           /* The client has sent its last byte */
+    server_ticket_t *first, *last; /* Replies not yet in out, oldest first */
+    size_t tickets;        /* How many; each keeps SERVER_REPLY bytes of out */
+    size_t in_used;
+    size_t out_start;      /* First byte not yet sent */
+    size_t out_used;
+    char in[SERVER_INPUT];
+    char out[SERVER_OUTPUT];
+};
+
+/*
+ * Room for replies to more lines: what out has left, less what the
+ * tickets still out will need.
+ */
+static int client_room(server_client_t *client)
+{
+    return client->out_used + (client->tickets + 1) * SERVER_REPLY <= SERVER_OUTPUT;
+}
+
+/*
+ * Take the next place among a client's replies.
+ */
+static server_ticket_t *ticket_take(server_client_t *client)
+{
+    server_ticket_t *ticket = malloc(sizeof(*ticket));
+
+    if (ticket == NULL)
+        errno_abort("Allocate reply ticket");
+    ticket->next = NULL;
+    ticket->client = client;
+    ticket->done = 0;
+    ticket->text[0] = '\0';
+    if (client->last != NULL)
+        client->last->next = ticket;
+    else
+        client->first = ticket;
+    client->last = ticket;
+    client->tickets++;
+    return ticket;
+}
+
+/*
+ * Queue a reply to a client. Never blocks; the server makes sure
+ * there is room for SERVER_REPLY bytes before it hands over a line,
+ * and a longer reply is cut short. Behind a ticket still out, the
+ * reply waits its turn in a ticket of its own.
+ */
+void server_reply(server_client_t *client, const char *format, ...)
+{
+    size_t room = SERVER_OUTPUT - client->out_used;
+    server_ticket_t *ticket;
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    if (client->first != NULL)
+    {
+        ticket = ticket_take(client);
+        vsnprintf(ticket->text, sizeof(ticket->text), format, args);
+        ticket->done = 1;
+        va_end(args);
+        return;
+    }
+    length = vsnprintf(client->out + client->out_used, room, format, args);
+    va_end(args);
+    if (length > 0)
+        client->out_used += (size_t)length < room ? (size_t)length : room - 1;
+}
+
+/*
+ * Keep the reply to the line being handled for later. Server
+ * thread only, from the line function.
+ */
+server_ticket_t *server_defer(server_client_t *client)
+{
+    return ticket_take(client);
+}
+
+/*
+ * Write a ticket's reply. Any thread, before server_answer.
+ */
+void server_fill(server_ticket_t *ticket, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(ticket->text, sizeof(ticket->text), format, args);
+    va_end(args);
+}
+
+/*
+ * Hand a filled-in ticket back to the server thread. Any thread;
+ * the ticket must not be used afterwards.
+ */
+void server_answer(alarm_server_t *server, server_ticket_t *ticket)
+{
+    uint64_t one = 1;
+
+    if (queue_push(&server->answered, &ticket->link) &&
+        write(server->wake, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        errno_abort("Wake server");
+}
+
+/*
+ * Hand the client's complete lines to the program, as long as its
+ * output buffer can take the replies. At the end of its input, a
+ * last line without a newline counts too.
+ */
+static void client_parse(alarm_server_t *server, server_client_t *client)
+{
+    char *next = client->in, *end = client->in + client->in_used, *newline;
+
+    while (client_room(client) &&
+           (newline = memchr(next, '\n', end - next)) != NULL)
+    {
+        server->line(client, next, newline - next);
+        next = newline + 1;
+    }
+    if (client_room(client) && next < end &&
+        (client->closing || (next == client->in && client->in_used == SERVER_INPUT)))
+    {
+        // The end of the input, or a line longer than the buffer: take what there is of it
+        server->line(client, next, end - next);
+        next = end;
+    }
+    client->in_used = end - next;
+    memmove(client->in, next, client->in_used);
+    server->batch();
+}
+
+/*
+ * Send what the client's socket will take. Returns -1 if the
+ * client has gone away.
+ */
+static int client_flush(server_client_t *client)
+{
+    ssize_t sent;
+
+    while (client->out_start < client->out_used)
+    {
+        sent = send(client->fd, client->out + client->out_start,
+                    client->out_used - client->out_start, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN ? 0 : -1;
+        }
+        client->out_start += sent;
+    }
+    client->out_start = client->out_used = 0;
+    return 0;
+}
+
+/*
+ * Move the replies at the front that are done into out. Those of a
+ * closed client are dropped, and the client is freed with its last
+ * ticket. Returns -1 if the client is gone.
+ */
+static int client_settle(server_client_t *client)
+{
+    server_ticket_t *ticket;
+    size_t length;
+
+    while ((ticket = client->first) != NULL && ticket->done)
+    {
+        if (client->fd != -1)
+        {
+            length = strlen(ticket->text);
+            memcpy(client->out + client->out_used, ticket->text, length);
+            client->out_used += length;
+        }
+        client->first = ticket->next;
+        if (client->first == NULL)
+            client->last = NULL;
+        client->tickets--;
+        free(ticket);
+    }
+    if (client->fd != -1)
+        return 0;
+    if (client->first == NULL)
+        free(client);
+    return -1;
+}
+
+/*
+ * Stop serving a client. Its memory stays until every ticket it
+ * holds has been answered.
+ */
+static void client_close(alarm_server_t *server, server_client_t *client)
+{
+    epoll_ctl(server->epoll, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+    client_settle(client);
+}
+
+/*
+ * Watch for input only while there is room to take it and reply
+ * to it, and for output only while replies are waiting.
+ */
+static void client_watch(alarm_server_t *server, server_client_t *client)
+{
+    struct epoll_event event;
+    int events = 0;
+
+    if (!client->closing && client->in_used < SERVER_INPUT && client_room(client))
+        events |= EPOLLIN;
+    if (client->out_used > 0)
+        events |= EPOLLOUT;
+    if (events == client->events)
+        return;
+    event.events = events;
+    event.data.ptr = client;
+    if (epoll_ctl(server->epoll, EPOLL_CTL_MOD, client->fd, &event) == -1)
+        errno_abort("Watch client");
+    client->events = events;
+}
+
+static void server_accept(alarm_server_t *server)
+{
+    struct epoll_event event;
+    server_client_t *client;
+    int fd;
+
+    while ((fd = accept4(server->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+    {
+        client = malloc(sizeof(*client));
+        if (client == NULL)
+            errno_abort("Allocate client");
+        client->fd = fd;
+        client->events = EPOLLIN;
+        client->closing = 0;
+        client->first = client->last = NULL;
+        client->tickets = 0;
+        client->in_used = client->out_start = client->out_used = 0;
+        event.events = EPOLLIN;
+        event.data.ptr = client;
+        if (epoll_ctl(server->epoll, EPOLL_CTL_ADD, fd, &event) == -1)
+            errno_abort("Watch client");
+    }
+    if (errno != EAGAIN && errno != ECONNABORTED && errno != EINTR)
+        errno_abort("Accept client");
+}
+
+/*
+ * Handle what a client has sent, and send what replies are ready.
+ */
+static void client_serve(alarm_server_t *server, server_client_t *client)
+{
+    client_parse(server, client);
+    client_settle(client);
+    if (client_flush(client) != 0)
+    {
+        client_close(server, client);
+        return;
+    }
+
+    // Replies may have drained enough to handle input that was waiting
+    while (client->in_used > 0 && client->out_used == 0)
+    {
+        size_t before = client->in_used;
+
+        client_parse(server, client);
+        client_settle(client);
+        if (client_flush(client) != 0)
+        {
+            client_close(server, client);
+            return;
+        }
+        if (client->in_used == before)
+            break;
+    }
+    if (client->closing && client->out_used == 0 && client->first == NULL)
+    {
+        client_close(server, client);
+        return;
+    }
+    client_watch(server, client);
+}
+
+/*
+ * Take the tickets handed back since the last wakeup, and send
+ * every reply they let through.
+ */
+static void server_answered(alarm_server_t *server)
+{
+    queue_node_t *node, *next;
+    server_ticket_t *ticket;
+    server_client_t *client;
+    uint64_t count;
+
+    if (read(server->wake, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        errno_abort("Read server wakeup");
+    for (node = queue_take(&server->answered); node != NULL; node = next)
+    {
+        next = node->next;
+        ticket = queue_entry(node, server_ticket_t, link);
+        client = ticket->client;
+        ticket->done = 1;
+        if (client_settle(client) == 0)
+            client_serve(server, client);
+    }
+}
+
+/*
+ * Take what a client has sent, handle it, and send the replies.
+ */
+static void client_ready(alarm_server_t *server, server_client_t *client, int events)
+{
+    ssize_t bytes;
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR) && client->events & EPOLLIN)
+    {
+        bytes = read(client->fd, client->in + client->in_used, SERVER_INPUT - client->in_used);
+        if (bytes == 0)
+            client->closing = 1;
+        else if (bytes == -1 && errno != EAGAIN && errno != EINTR)
+        {
+            client_close(server, client);
+            return;
+        }
+        else if (bytes > 0)
+            client->in_used += bytes;
+    }
+
+    // A client that has hung up cannot take the replies still to come
+    if (client->closing && events & (EPOLLHUP | EPOLLERR) && client->out_used == 0)
+    {
+        client_close(server, client);
+        return;
+    }
+    client_serve(server, client);
+}
+
+/*
+ * Block SIGINT and SIGTERM, and listen on "path". Call this before
+ * the program creates any thread, so that every thread inherits the
+ * blocked mask and only server_run sees those signals.
+ */
+void server_init(alarm_server_t *server, const char *path, server_line_t line,
+                 server_batch_t batch)
+{
+    struct sockaddr_un address;
+    struct epoll_event event;
+    sigset_t signals;
+    int status;
+
+    server->path = path;
+    server->line = line;
+    server->batch = batch;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    status = pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if (status != 0)
+        err_abort(status, "Block server signals");
+    server->signal = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (server->signal == -1)
+        errno_abort("Create server signalfd");
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(address.sun_path, path);
+    unlink(path); // Left behind by an earlier run
+    server->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->listener == -1)
+        errno_abort("Create server socket");
+    if (bind(server->listener, (struct sockaddr *)&address, sizeof(address)) == -1)
+        errno_abort("Bind server socket");
+    if (listen(server->listener, SOMAXCONN) == -1)
+        errno_abort("Listen on server socket");
+
+    server->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epoll == -1)
+        errno_abort("Create server epoll");
+    event.events = EPOLLIN;
+    event.data.ptr = &server->listener;
+    if (epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->listener, &event) == -1)
+        errno_abort("Watch server socket");
+    event.data.ptr = &server->signal;
+    if (epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->signal, &event) == -1)
+        errno_abort("Watch server signals");
+
+    queue_init(&server->answered);
+    server->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server->wake == -1)
+        errno_abort("Create server eventfd");
+    event.data.ptr = &server->wake;
+    if (epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->wake, &event) == -1)
+        errno_abort("Watch server wakeups");
+}
+
+/*
+ * Serve clients until SIGINT or SIGTERM arrives. Clients still
+ * connected then are dropped; their input has been handled up to
+ * the last line they were sent a reply for.
+ */
+void server_run(alarm_server_t *server)
+{
+    struct epoll_event events[SERVER_EVENTS];
+    int ready, i;
+
+    while (1)
+    {
+        ready = epoll_wait(server->epoll, events, SERVER_EVENTS, -1);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            errno_abort("Wait for server events");
+        }
+        for (i = 0; i < ready; i++)
+        {
+            if (events[i].data.ptr == &server->listener)
+                server_accept(server);
+            else if (events[i].data.ptr == &server->wake)
+                server_answered(server);
+            else if (events[i].data.ptr == &server->signal)
+            {
+                unlink(server->path);
+                return;
+            }
+            else
+                client_ready(server, events[i].data.ptr, events[i].events);
+        }
+    }
+}
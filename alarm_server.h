@@ -0,0 +1,68 @@
+#ifndef __alarm_server_h
+#define __alarm_server_h
+
+#include <stddef.h>
+#include "alarm_queue.h"
+
+/*
+ * A Unix domain stream socket front end for a line protocol. One
+ * thread serves every client from a single epoll set: whatever a
+ * client has sent is split into lines and handed to the program's
+ * line function, and then the batch function is called once, so
+ * that the program can submit everything the client pipelined in
+ * one step. Replies gather in a per-client buffer and are written
+ * once the batch is done.
+ *
+ * A line whose reply is not known yet takes a ticket instead
+ * (server_defer). The reply's place among the client's replies is
+ * kept, and whatever follows it waits; any thread may later fill
+ * the ticket in and hand it back with server_answer, which wakes
+ * the server thread to send it.
+ *
+ * A client that does not read its replies is not read from either:
+ * once its output buffer is nearly full the server stops taking
+ * lines from it until the buffer drains, so a slow client costs
+ * bounded memory and never holds up the others.
+ */
+#define SERVER_INPUT (64 * 1024)   /* Bytes of unparsed input per client */
+#define SERVER_OUTPUT (64 * 1024)  /* Bytes of unsent replies per client */
+#define SERVER_REPLY 256           /* Longest reply to one line */
+#define SERVER_EVENTS 64           /* Events taken per epoll_wait */
+
+typedef struct server_client_tag server_client_t;
+typedef struct server_ticket_tag server_ticket_t;
+
+/*
+ * Handle one line from "client"; "length" does not include the
+ * newline. Replies go through server_reply.
+ */
+typedef void (*server_line_t)(server_client_t *client, const char *line, size_t length);
+
+/*
+ * Called after the lines of one read from one client.
+ */
+typedef void (*server_batch_t)(void);
+
+typedef struct alarm_server_tag
+{
+    int epoll;
+    int listener;
+    int signal;          /* SIGINT and SIGTERM end server_run */
+    int wake;            /* eventfd: tickets have been answered */
+    alarm_queue_t answered;
+    const char *path;
+    server_line_t line;
+    server_batch_t batch;
+} alarm_server_t;
+
+void server_init(alarm_server_t *server, const char *path, server_line_t line,
+                 server_batch_t batch);
+void server_run(alarm_server_t *server);
+void server_reply(server_client_t *client, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+server_ticket_t *server_defer(server_client_t *client);
+void server_fill(server_ticket_t *ticket, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void server_answer(alarm_server_t *server, server_ticket_t *ticket);
+
+#endif
@@ -0,0 +1,216 @@
+/*
+ * alarm_slab.c
+ *
+ * Slab allocator for alarm_t and change_alarm_t. See alarm_slab.h
+ * for the design; the interesting part is how objects move between
+ * threads. A free always goes into the freeing thread's own cache.
+ * Half of a full cache is linked into a chain and pushed onto the
+ * slab's "returned" stack with one compare-and-swap, and an empty
+ * cache takes the entire stack with one exchange. Since nothing
+ * ever pops a single object off the shared stack, there is no ABA
+ * problem to guard against.
+ */
+#include "errors.h"
+#include "alarm_slab.h"
+
+/*
+ * A thread publishes its allocation count after this many net
+ * allocations or frees, which bounds how stale slab_stats can be.
+ */
+#define SLAB_PUBLISH 32
+
+typedef struct slab_cache_tag
+{
+    slab_object_t *free; /* This thread's free objects */
+    size_t count;
+    long in_use;         /* Allocations minus frees not yet published */
+} slab_cache_t;
+
+static __thread slab_cache_t slab_caches[SLAB_TYPES_MAX];
+static slab_t *slab_registry[SLAB_TYPES_MAX];
+static atomic_int slab_count;
+static pthread_key_t slab_key;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Publish a cache's allocation count, so that slab_stats does not
+ * drift too far from the truth.
+ */
+static void slab_publish(slab_t *slab, slab_cache_t *cache)
+{
+    atomic_fetch_add_explicit(&slab->in_use, cache->in_use, memory_order_relaxed);
+    cache->in_use = 0;
+}
+
+/*
+ * Push "count" objects from the front of a thread's cache onto the
+ * slab's returned stack, as one chain.
+ */
+static void slab_return(slab_t *slab, slab_cache_t *cache, size_t count)
+{
+    slab_object_t *first = cache->free, *last = first, *top;
+    size_t i;
+
+    if (count == 0)
+        return;
+    for (i = 1; i < count; i++)
+        last = last->next;
+    cache->free = last->next;
+    cache->count -= count;
+    top = atomic_load_explicit(&slab->returned, memory_order_relaxed);
+    do
+        last->next = top;
+    while (!atomic_compare_exchange_weak_explicit(&slab->returned, &top, first,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+}
+
+/*
+ * When a thread exits, its cached objects go back to the slab so
+ * that other threads can use them.
+ */
+static void slab_thread_exit(void *arg)
+{
+    int i, count = atomic_load(&slab_count);
+
+    for (i = 0; i < count; i++)
+    {
+        slab_return(slab_registry[i], &slab_caches[i], slab_caches[i].count);
+        slab_publish(slab_registry[i], &slab_caches[i]);
+    }
+}
+
+static void slab_key_init(void)
+{
+    int status = pthread_key_create(&slab_key, slab_thread_exit);
+
+    if (status != 0)
+        err_abort(status, "Create slab key");
+}
+
+/*
+ * Carve a new chunk and put all of its objects in the calling
+ * thread's cache. The first object slot of every chunk holds the
+ * link to the previous chunk.
+ */
+static void slab_grow(slab_t *slab, slab_cache_t *cache)
+{
+    slab_object_t *chunk, *object;
+    size_t i;
+    int status;
+
+    chunk = malloc(SLAB_CHUNK_SIZE);
+    if (chunk == NULL)
+        errno_abort("Allocate slab chunk");
+    for (i = 1; i <= slab->per_chunk; i++)
+    {
+        object = (slab_object_t *)((char *)chunk + i * slab->size);
+        object->next = cache->free;
+        cache->free = object;
+    }
+    cache->count += slab->per_chunk;
+
+    status = pthread_mutex_lock(&slab->lock);
+    if (status != 0)
+        err_abort(status, "Lock slab");
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+    status = pthread_mutex_unlock(&slab->lock);
+    if (status != 0)
+        err_abort(status, "Unlock slab");
+    atomic_fetch_add(&slab->chunk_count, 1);
+}
+
+void slab_init(slab_t *slab, const char *name, size_t size)
+{
+    int status;
+
+    pthread_once(&slab_once, slab_key_init);
+    slab->name = name;
+    slab->size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (slab->size < sizeof(slab_object_t))
+        slab->size = sizeof(slab_object_t);
+    slab->per_chunk = SLAB_CHUNK_SIZE / slab->size - 1;
+    slab->chunks = NULL;
+    atomic_init(&slab->returned, NULL);
+    atomic_init(&slab->chunk_count, 0);
+    atomic_init(&slab->in_use, 0);
+    status = pthread_mutex_init(&slab->lock, NULL);
+    if (status != 0)
+        err_abort(status, "Init slab lock");
+    slab->id = atomic_fetch_add(&slab_count, 1);
+    if (slab->id >= SLAB_TYPES_MAX)
+    {
+        fprintf(stderr, "Too many slabs\n");
+        abort();
+    }
+    slab_registry[slab->id] = slab;
+}
+
+void *slab_alloc(slab_t *slab)
+{
+    slab_cache_t *cache = &slab_caches[slab->id];
+    slab_object_t *object;
+
+    if (cache->free == NULL)
+    {
+        /*
+         * Mark the thread as a slab user, so that its cache is
+         * handed back when it exits.
+         */
+        if (pthread_getspecific(slab_key) == NULL)
+            pthread_setspecific(slab_key, slab);
+        slab_publish(slab, cache);
+        cache->free = atomic_exchange_explicit(&slab->returned, NULL, memory_order_acquire);
+        for (object = cache->free; object != NULL; object = object->next)
+            cache->count++;
+        if (cache->free == NULL)
+            slab_grow(slab, cache);
+    }
+    object = cache->free;
+    cache->free = object->next;
+    cache->count--;
+    if (++cache->in_use >= SLAB_PUBLISH)
+        slab_publish(slab, cache);
+    return object;
+}
+
+void slab_free(slab_t *slab, void *object)
+{
+    slab_cache_t *cache = &slab_caches[slab->id];
+    slab_object_t *free_object = (slab_object_t *)object;
+
+    free_object->next = cache->free;
+    cache->free = free_object;
+    cache->count++;
+    if (--cache->in_use <= -SLAB_PUBLISH)
+        slab_publish(slab, cache);
+    if (cache->count >= SLAB_CACHE_MAX)
+    {
+        if (pthread_getspecific(slab_key) == NULL)
+            pthread_setspecific(slab_key, slab);
+        slab_return(slab, cache, SLAB_CACHE_MAX / 2);
+        slab_publish(slab, cache);
+    }
+}
+
+void slab_stats(slab_t *slab, slab_stats_t *stats)
+{
+    size_t chunks = atomic_load(&slab->chunk_count);
+
+    stats->size = slab->size;
+    stats->capacity = chunks * slab->per_chunk;
+    stats->in_use = atomic_load(&slab->in_use);
+    if (stats->in_use < 0)
+        stats->in_use = 0;
+    stats->bytes = chunks * SLAB_CHUNK_SIZE;
+}
+
+void slab_report(slab_t *slab, FILE *stream)
+{
+    slab_stats_t stats;
+
+    slab_stats(slab, &stats);
+    fprintf(stream, "Slab %s: %ld of %zu objects in use (%zu bytes each), %zu KiB in chunks\n",
+            slab->name, stats.in_use, stats.capacity, stats.size, stats.bytes / 1024);
+}
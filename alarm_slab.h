@@ -0,0 +1,56 @@
+#ifndef __alarm_slab_h
+#define __alarm_slab_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * A fixed-size object allocator for the alarm nodes. Objects are
+ * carved out of large chunks that are never returned to malloc.
+ * Every thread keeps a private cache of free objects, so the
+ * common alloc and free touch no shared state at all. When a
+ * thread that mostly frees (the alarm monitor) overfills its
+ * cache, it hands a batch back on the slab's lock-free "returned"
+ * stack, and a thread that mostly allocates (the main thread)
+ * takes the whole stack in one atomic exchange when its cache
+ * runs dry. The mutex is only taken to carve a new chunk.
+ */
+#define SLAB_TYPES_MAX 8    /* Slabs a program may create */
+#define SLAB_CACHE_MAX 256  /* Free objects a thread keeps */
+#define SLAB_CHUNK_SIZE (64 * 1024)
+
+typedef struct slab_object_tag
+{
+    struct slab_object_tag *next;
+} slab_object_t;
+
+typedef struct slab_tag
+{
+    const char *name;
+    size_t size;                       /* Object size, pointer aligned */
+    size_t per_chunk;                  /* Objects carved per chunk */
+    int id;                            /* Index of this slab's thread caches */
+    pthread_mutex_t lock;              /* Protects the chunk list */
+    slab_object_t *chunks;             /* Every chunk, for the statistics */
+    _Atomic(slab_object_t *) returned; /* Batches freed by other threads */
+    atomic_size_t chunk_count;
+    atomic_long in_use;                /* Lags by a few dozen per thread */
+} slab_t;
+
+typedef struct slab_stats_tag
+{
+    size_t size;     /* Bytes per object */
+    size_t capacity; /* Objects carved so far */
+    long in_use;     /* Objects allocated and not yet freed */
+    size_t bytes;    /* Memory held in chunks */
+} slab_stats_t;
+
+void slab_init(slab_t *slab, const char *name, size_t size);
+void *slab_alloc(slab_t *slab);
+void slab_free(slab_t *slab, void *object);
+void slab_stats(slab_t *slab, slab_stats_t *stats);
+void slab_report(slab_t *slab, FILE *stream);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * alarm_time.c
+ *
+ * Parsing and printing of alarm timeouts. A timeout is a number of
+ * seconds with an optional fraction, optionally followed by "s",
+ * or a whole or fractional number of milliseconds followed by
+ * "ms": "5", "1.5", "0.25s" and "250ms" are all accepted.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "alarm_time.h"
+
+/*
+ * The longest timeout accepted, about 31 years, keeps every
+ * deadline well inside 64 bits of nanoseconds.
+ */
+#define TIMEOUT_MAX_SEC 1000000000ull
+
+/*
+ * Convert a timeout to nanoseconds. Returns 0 on success, or -1 if
+ * the text is not a timeout.
+ */
+int parse_timeout(const char *text, uint64_t *ns)
+{
+    uint64_t whole = 0, fraction = 0, scale = 1, unit = NSEC_PER_SEC;
+    const char *p = text;
+
+    if (*p < '0' || *p > '9')
+        return -1;
+    while (*p >= '0' && *p <= '9')
+    {
+        whole = whole * 10 + (*p++ - '0');
+        if (whole > TIMEOUT_MAX_SEC * 1000)
+            return -1;
+    }
+    if (*p == '.')
+    {
+        for (p++; *p >= '0' && *p <= '9'; p++)
+        {
+            // Digits beyond nanosecond resolution are ignored
+            if (scale < NSEC_PER_SEC)
+            {
+                fraction = fraction * 10 + (*p - '0');
+                scale *= 10;
+            }
+        }
+    }
+    if (strcmp(p, "ms") == 0)
+        unit = NSEC_PER_MSEC;
+    else if (strcmp(p, "s") != 0 && *p != '\0')
+        return -1;
+
+    // Bounded before it is scaled, so that whole * unit cannot wrap
+    if (whole > (unit == NSEC_PER_SEC ? TIMEOUT_MAX_SEC : TIMEOUT_MAX_SEC * 1000))
+        return -1;
+    *ns = whole * unit + fraction * unit / scale;
+    return 0;
+}
+
+/*
+ * Print a timeout as seconds, without trailing zeros: "5", "1.5",
+ * "0.25". Returns "buffer".
+ */
+char *format_timeout(uint64_t ns, char *buffer, size_t size)
+{
+    int length;
+
+    length = snprintf(buffer, size, "%llu.%09llu",
+                      (unsigned long long)(ns / NSEC_PER_SEC),
+                      (unsigned long long)(ns % NSEC_PER_SEC));
+    if (length > 0 && (size_t)length < size)
+    {
+        while (buffer[length - 1] == '0')
+            buffer[--length] = '\0';
+        if (buffer[length - 1] == '.')
+            buffer[--length] = '\0';
+    }
+    return buffer;
+}
+
+#ifdef TIMEOUT_CHECK
+/*
+ * Boundary cases for parse_timeout ("make check"): the largest
+ * timeouts in each unit, the first ones past them, and values whose
+ * scaled form would wrap 64 bits if it were computed before the
+ * range check.
+ */
+static const struct
+{
+    const char *text;
+    int status;
+    uint64_t ns;
+} timeout_cases[] = {
+    {"0", 0, 0},
+    {"1.5", 0, 1500000000ull},
+    {"250ms", 0, 250000000ull},
+    {"1000000000", 0, TIMEOUT_MAX_SEC * NSEC_PER_SEC},
+    {"1000000001", -1, 0},
+    {"1000000000000ms", 0, TIMEOUT_MAX_SEC * NSEC_PER_SEC},
+    {"1000000000001ms", -1, 0},
+    {"18446744074", -1, 0},
+    {"19000000000", -1, 0},
+    {"18446744073709551616ms", -1, 0},
+    {"5x", -1, 0},
+    {"", -1, 0},
+};
+
+int main(void)
+{
+    int failures = 0, status;
+    uint64_t ns;
+
+    for (size_t i = 0; i < sizeof(timeout_cases) / sizeof(timeout_cases[0]); i++)
+    {
+        ns = 0;
+        status = parse_timeout(timeout_cases[i].text, &ns);
+        if (status != timeout_cases[i].status || (status == 0 && ns != timeout_cases[i].ns))
+        {
+            printf("parse_timeout(\"%s\"): %d, %llu ns\n", timeout_cases[i].text, status,
+                   (unsigned long long)ns);
+            failures++;
+        }
+    }
+    printf("%d of %zu timeout cases failed\n", failures,
+           sizeof(timeout_cases) / sizeof(timeout_cases[0]));
+    return failures != 0;
+}
+#endif
@@ -0,0 +1,38 @@
+#ifndef __alarm_time_h
+#define __alarm_time_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Alarm deadlines are 64-bit CLOCK_MONOTONIC nanoseconds. The
+ * monotonic clock is not stepped when the wall clock is set, so a
+ * correction of the system time neither fires nor delays pending
+ * alarms, and the resolution is fine enough for sub-second
+ * timeouts.
+ */
+#define NSEC_PER_MSEC 1000000ull
+#define NSEC_PER_SEC 1000000000ull
+
+static inline uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+static inline struct timespec ns_to_timespec(uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / NSEC_PER_SEC;
+    ts.tv_nsec = ns % NSEC_PER_SEC;
+    return ts;
+}
+
+int parse_timeout(const char *text, uint64_t *ns);
+char *format_timeout(uint64_t ns, char *buffer, size_t size);
+
+#endif
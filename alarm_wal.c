@@ -0,0 +1,624 @@
+/*
+ * alarm_wal.c
+ *
+ * Write-ahead log and snapshots: see alarm_wal.h.
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "errors.h"
+#include "alarm_time.h"
+#include "alarm_wal.h"
+
+#define SNAPSHOT_MAGIC "ALRMSNAP"
+#define SNAPSHOT_VERSION 2
+
+typedef struct snapshot_header_tag
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t segment;  /* First log segment not covered */
+    uint64_t count;    /* Records that follow */
+} snapshot_header_t;
+
+/*
+ * The records of a snapshot, copied out while the caller's alarms
+ * are held still, until the child has been forked to write them.
+ */
+struct wal_snapshot_tag
+{
+    alarm_wal_t *wal;
+    char *data;
+    size_t used;
+    size_t size;
+    uint64_t count;
+    uint64_t segment;  /* First log segment not covered */
+};
+
+/*
+ * The checksum of the record at "buf", whose message is "length"
+ * bytes long. Records follow each other with no padding, so "buf"
+ * may be misaligned for wal_record_t: records are only ever copied
+ * in and out of a buffer, never accessed in place.
+ */
+static uint32_t record_checksum(const char *buf, size_t length)
+{
+    const unsigned char *byte = (const unsigned char *)buf + sizeof(uint32_t);
+    const unsigned char *end = (const unsigned char *)buf + sizeof(wal_record_t) + length;
+    uint32_t hash = 2166136261u;
+
+    for (; byte < end; byte++)
+        hash = (hash ^ *byte) * 16777619u;
+    return hash;
+}
+
+/*
+ * Fill in a record and its message at "buf", and return its size.
+ */
+static size_t record_build(char *buf, int type, int alarm_id, int group_id, int64_t deadline,
+                           uint64_t period, const char *message)
+{
+    wal_record_t record;
+    size_t length = message != NULL ? strlen(message) : 0;
+
+    if (length > UINT8_MAX)
+        length = UINT8_MAX;
+    record.checksum = 0;
+    record.type = type;
+    record.length = length;
+    record.reserved = 0;
+    record.alarm_id = alarm_id;
+    record.group_id = group_id;
+    record.deadline = deadline;
+    record.period = period;
+    memcpy(buf, &record, sizeof(record));
+    memcpy(buf + sizeof(record), message, length);
+    record.checksum = record_checksum(buf, length);
+    memcpy(buf, &record.checksum, sizeof(record.checksum));
+    return sizeof(record) + length;
+}
+
+static void segment_path(alarm_wal_t *wal, uint64_t segment, char *path, size_t size)
+{
+    snprintf(path, size, "%s/wal.%llu", wal->dir, (unsigned long long)segment);
+}
+
+static int segment_open(alarm_wal_t *wal, uint64_t segment)
+{
+    char path[300];
+    int fd, dir;
+
+    segment_path(wal, segment, path, sizeof(path));
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+        errno_abort("Open log segment");
+
+    // Make the new name itself durable
+    dir = open(wal->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir != -1)
+    {
+        fsync(dir);
+        close(dir);
+    }
+    return fd;
+}
+
+static void write_all(int fd, const char *buf, size_t size)
+{
+    ssize_t written;
+
+    while (size > 0)
+    {
+        written = write(fd, buf, size);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            errno_abort("Write log");
+        }
+        buf += written;
+        size -= written;
+    }
+}
+
+/*
+ * Map a file read-only. Returns NULL, with *size 0, if it is
+ * missing or empty.
+ */
+static char *map_file(const char *path, size_t *size)
+{
+    struct stat info;
+    char *base;
+    int fd;
+
+    *size = 0;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    if (fstat(fd, &info) == -1 || info.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    base = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+    madvise(base, info.st_size, MADV_SEQUENTIAL);
+    *size = info.st_size;
+    return base;
+}
+
+/*
+ * Hand every record in "base" to "apply". A log segment ends early
+ * at the first record that is cut short or fails its checksum: the
+ * tail of a commit that a crash interrupted. Snapshot records are
+ * not checksummed, since a snapshot is only renamed into place once
+ * it is complete. Returns the number of records applied.
+ */
+static long replay(alarm_wal_t *wal, const char *base, size_t size, int check,
+                   wal_apply_t apply, void *arg)
+{
+    const char *next = base, *end = base + size;
+    wal_record_t record;
+    int64_t deadline;
+    long count = 0;
+
+    while ((size_t)(end - next) >= sizeof(record))
+    {
+        memcpy(&record, next, sizeof(record));
+        if (record.type < WAL_START || record.type > WAL_REARM ||
+            (size_t)(end - next) < sizeof(record) + record.length ||
+            (check && record.checksum != record_checksum(next, record.length)))
+            break;
+        deadline = record.deadline - wal->clock_offset;
+        apply(arg, record.type, record.alarm_id, record.group_id,
+              deadline > 0 ? (uint64_t)deadline : 0, record.period,
+              next + sizeof(record), record.length);
+        next += sizeof(record) + record.length;
+        count++;
+    }
+    return count;
+}
+
+static int compare_segments(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Set the log up in "dir" (created if need be), and map the
+ * snapshot and every log segment after it, for wal_replay. Returns
+ * an upper bound on the alarms they hold, so that the caller can
+ * size its index once.
+ */
+size_t wal_open(alarm_wal_t *wal, const char *dir)
+{
+    uint64_t *segments = NULL;
+    const snapshot_header_t *header;
+    struct timespec real;
+    struct dirent *entry;
+    char path[300];
+    unsigned long long number;
+    size_t count = 0, segments_size = 0, bound = 0, i;
+    wal_map_t snapshot;
+    uint64_t covered = 0;
+    wal_map_t *map;
+    DIR *listing;
+
+    memset(wal, 0, sizeof(*wal));
+    snprintf(wal->dir, sizeof(wal->dir), "%s", dir);
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+        errno_abort("Create log directory");
+    clock_gettime(CLOCK_REALTIME, &real);
+    wal->clock_offset = (int64_t)((uint64_t)real.tv_sec * NSEC_PER_SEC + real.tv_nsec) -
+                        (int64_t)monotonic_ns();
+
+    snprintf(path, sizeof(path), "%s/snapshot", dir);
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.base = map_file(path, &snapshot.size);
+    header = (const snapshot_header_t *)snapshot.base;
+    if (snapshot.base != NULL && snapshot.size >= sizeof(*header) &&
+        memcmp(header->magic, SNAPSHOT_MAGIC, 8) == 0 && header->version == SNAPSHOT_VERSION)
+    {
+        covered = header->segment;
+        bound += header->count;
+    }
+    else if (snapshot.base != NULL)
+    {
+        munmap(snapshot.base, snapshot.size);
+        snapshot.base = NULL;
+    }
+
+    listing = opendir(dir);
+    if (listing == NULL)
+        errno_abort("List log directory");
+    while ((entry = readdir(listing)) != NULL)
+    {
+        if (sscanf(entry->d_name, "wal.%llu", &number) != 1)
+            continue;
+        if (number < covered)
+        {
+            // Covered by the snapshot, but the child did not get to remove it
+            segment_path(wal, number, path, sizeof(path));
+            unlink(path);
+        }
+        else
+        {
+            if (count == segments_size)
+            {
+                segments_size = segments_size == 0 ? 64 : segments_size * 2;
+                segments = realloc(segments, segments_size * sizeof(*segments));
+                if (segments == NULL)
+                    errno_abort("Allocate log segment list");
+            }
+            segments[count++] = number;
+        }
+    }
+    closedir(listing);
+    qsort(segments, count, sizeof(segments[0]), compare_segments);
+
+    // Every segment found is replayed, however many there are
+    wal->maps = calloc(count + 1, sizeof(*wal->maps));
+    if (wal->maps == NULL)
+        errno_abort("Allocate log maps");
+    if (snapshot.base != NULL)
+        wal->maps[wal->map_count++] = snapshot;
+
+    for (i = 0; i < count; i++)
+    {
+        segment_path(wal, segments[i], path, sizeof(path));
+        map = &wal->maps[wal->map_count];
+        if ((map->base = map_file(path, &map->size)) == NULL)
+            continue;
+        map->checked = 1;
+        bound += map->size / sizeof(wal_record_t);
+        wal->map_count++;
+    }
+
+    // New records go to a fresh segment, after any torn tail
+    wal->oldest = count > 0 ? segments[0] : covered;
+    wal->segment = count > 0 ? segments[count - 1] + 1 : covered;
+    wal->snapshot_time = time(NULL);
+    free(segments);
+    return bound;
+}
+
+/*
+ * Hand every record wal_open found to "apply", oldest first, and
+ * unmap the files. Returns the number of records replayed. Call
+ * wal_start afterwards.
+ */
+long wal_replay(alarm_wal_t *wal, wal_apply_t apply, void *arg)
+{
+    long records = 0;
+    wal_map_t *map;
+    size_t i;
+
+    for (i = 0; i < wal->map_count; i++)
+    {
+        map = &wal->maps[i];
+        if (map->checked)
+        {
+            records += replay(wal, map->base, map->size, 1, apply, arg);
+            // A long log is worth folding into a snapshot soon
+            wal->appended += map->size;
+        }
+        else
+            records += replay(wal, map->base + sizeof(snapshot_header_t),
+                              map->size - sizeof(snapshot_header_t), 0, apply, arg);
+        munmap(map->base, map->size);
+    }
+    free(wal->maps);
+    wal->maps = NULL;
+    wal->map_count = 0;
+    return records;
+}
+
+static void *wal_writer(void *arg)
+{
+    alarm_wal_t *wal = arg;
+    size_t size, rotate_at = 0;
+    uint64_t segment = 0, committing;
+    int rotating;
+    char *buf;
+
+    pthread_mutex_lock(&wal->lock);
+    while (1)
+    {
+        while (wal->pending_size == 0 && !wal->rotating)
+            pthread_cond_wait(&wal->ready, &wal->lock);
+
+        // Take the whole gathered batch; the next one gathers in the other buffer
+        buf = wal->pending;
+        wal->pending = wal->writing;
+        wal->writing = buf;
+        size = wal->pending_size;
+        wal->pending_size = 0;
+        committing = wal->logged;
+        rotating = wal->rotating;
+        if (rotating)
+        {
+            rotate_at = wal->rotate_at;
+            segment = wal->segment;
+            wal->rotating = 0;
+        }
+        wal->busy = 1;
+        pthread_cond_broadcast(&wal->space);
+        pthread_mutex_unlock(&wal->lock);
+
+        if (rotating)
+        {
+            write_all(wal->fd, buf, rotate_at);
+            fdatasync(wal->fd);
+            close(wal->fd);
+            wal->fd = segment_open(wal, segment);
+            buf += rotate_at;
+            size -= rotate_at;
+        }
+        write_all(wal->fd, buf, size);
+        if (fdatasync(wal->fd) == -1)
+            errno_abort("Sync log");
+
+        pthread_mutex_lock(&wal->lock);
+        wal->busy = 0;
+        wal->durable = committing;
+        pthread_cond_broadcast(&wal->space);
+    }
+    return NULL;
+}
+
+/*
+ * Open the segment recovery chose, and start the writer thread.
+ */
+void wal_start(alarm_wal_t *wal)
+{
+    int status;
+
+    wal->pending = malloc(WAL_BUFFER);
+    wal->writing = malloc(WAL_BUFFER);
+    if (wal->pending == NULL || wal->writing == NULL)
+        errno_abort("Allocate log buffers");
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->ready, NULL);
+    pthread_cond_init(&wal->space, NULL);
+    wal->fd = segment_open(wal, wal->segment);
+    status = pthread_create(&wal->writer, NULL, wal_writer, wal);
+    if (status != 0)
+        err_abort(status, "Create log writer");
+}
+
+/*
+ * Log one event. "deadline" is CLOCK_MONOTONIC nanoseconds;
+ * "message" may be NULL. This only waits if the writer has fallen
+ * a whole buffer behind.
+ */
+void wal_append(alarm_wal_t *wal, int type, int alarm_id, int group_id, uint64_t deadline,
+                uint64_t period, const char *message)
+{
+    size_t size;
+
+    pthread_mutex_lock(&wal->lock);
+    while (wal->pending_size + sizeof(wal_record_t) + UINT8_MAX > WAL_BUFFER)
+        pthread_cond_wait(&wal->space, &wal->lock);
+    size = record_build(wal->pending + wal->pending_size, type, alarm_id, group_id,
+                        (int64_t)deadline + wal->clock_offset, period, message);
+    if (wal->pending_size == 0)
+        pthread_cond_signal(&wal->ready);
+    wal->pending_size += size;
+    wal->appended += size;
+    wal->logged += size;
+    pthread_mutex_unlock(&wal->lock);
+}
+
+/*
+ * Wait until the writer is idle: everything logged is durable, and
+ * no segment switch is pending.
+ */
+void wal_flush(alarm_wal_t *wal)
+{
+    pthread_mutex_lock(&wal->lock);
+    while (wal->pending_size > 0 || wal->rotating || wal->busy)
+        pthread_cond_wait(&wal->space, &wal->lock);
+    pthread_mutex_unlock(&wal->lock);
+}
+
+/*
+ * Wait until everything logged so far is durable. Unlike wal_flush,
+ * this does not wait for records logged meanwhile, so it returns
+ * after at most two group commits however busy the log is.
+ */
+void wal_sync(alarm_wal_t *wal)
+{
+    uint64_t target;
+
+    pthread_mutex_lock(&wal->lock);
+    target = wal->logged;
+    while (wal->durable < target)
+        pthread_cond_wait(&wal->space, &wal->lock);
+    pthread_mutex_unlock(&wal->lock);
+}
+
+/*
+ * Make everything logged durable, and wait for a snapshot that is
+ * still being written, so that the next start finds the directory
+ * settled. The log must not be used afterwards.
+ */
+void wal_close(alarm_wal_t *wal)
+{
+    int status;
+
+    wal_flush(wal);
+    if (wal->snapshot_pid != 0 && waitpid(wal->snapshot_pid, &status, 0) == wal->snapshot_pid &&
+        WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        wal->oldest = wal->snapshot_segment;
+    wal->snapshot_pid = 0;
+}
+
+/*
+ * Whether it is time for a snapshot: enough has been logged since
+ * the last one, and no snapshot child is still at work. Reaps a
+ * child that has finished.
+ */
+int wal_snapshot_due(alarm_wal_t *wal)
+{
+    uint64_t appended;
+    int status;
+
+    if (wal->snapshot_pid != 0)
+    {
+        if (waitpid(wal->snapshot_pid, &status, WNOHANG) != wal->snapshot_pid)
+            return 0;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            wal->oldest = wal->snapshot_segment;
+        wal->snapshot_pid = 0;
+    }
+    // Every monitor appends, so the count is only read under the lock
+    pthread_mutex_lock(&wal->lock);
+    appended = wal->appended;
+    pthread_mutex_unlock(&wal->lock);
+    return appended >= WAL_SNAPSHOT_BYTES ||
+           (appended > 0 && time(NULL) - wal->snapshot_time >= WAL_SNAPSHOT_INTERVAL);
+}
+
+/*
+ * Add one pending alarm to a snapshot; "deadline" is CLOCK_MONOTONIC
+ * nanoseconds. Only called from a wal_walk_t.
+ */
+void wal_snapshot_add(wal_snapshot_t *snapshot, int alarm_id, int group_id, uint64_t deadline,
+                      uint64_t period, const char *message)
+{
+    if (snapshot->used + sizeof(wal_record_t) + UINT8_MAX > snapshot->size)
+    {
+        snapshot->size = snapshot->size == 0 ? WAL_BUFFER : snapshot->size * 2;
+        snapshot->data = realloc(snapshot->data, snapshot->size);
+        if (snapshot->data == NULL)
+            errno_abort("Allocate snapshot");
+    }
+    snapshot->used += record_build(snapshot->data + snapshot->used, WAL_START, alarm_id, group_id,
+                                   (int64_t)deadline + snapshot->wal->clock_offset, period,
+                                   message);
+    snapshot->count++;
+}
+
+/*
+ * The snapshot child. It only makes system calls, since any lock
+ * another thread of the parent held at the fork stays held here.
+ */
+static void snapshot_write(alarm_wal_t *wal, wal_snapshot_t *snapshot)
+{
+    snapshot_header_t header;
+    char path[300], temporary[300];
+    const char *next = snapshot->data;
+    size_t left = snapshot->used;
+    ssize_t written;
+    uint64_t old;
+    int fd, dir;
+
+    snprintf(path, sizeof(path), "%s/snapshot", wal->dir);
+    snprintf(temporary, sizeof(temporary), "%s/snapshot.tmp", wal->dir);
+    fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        _exit(1);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.segment = snapshot->segment;
+    header.count = snapshot->count;
+    if (write(fd, &header, sizeof(header)) != sizeof(header))
+        _exit(1);
+    while (left > 0)
+    {
+        written = write(fd, next, left);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            _exit(1);
+        next += written;
+        left -= written;
+    }
+    if (fsync(fd) == -1 || rename(temporary, path) == -1)
+        _exit(1);
+    dir = open(wal->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir != -1)
+        fsync(dir);
+
+    // Everything before the snapshot's segment is now in the snapshot
+    for (old = wal->oldest; old < snapshot->segment; old++)
+    {
+        segment_path(wal, old, path, sizeof(path));
+        unlink(path);
+    }
+    _exit(0);
+}
+
+/*
+ * Take a snapshot of what "walk" reports: start a new log segment,
+ * and copy every alarm into memory. The caller must keep its alarms
+ * from changing until this returns, and then start the snapshot
+ * with wal_snapshot_write, once it has let them go: the copy costs
+ * time in proportion to the alarms, while the fork that writes it
+ * out costs time in proportion to the whole process. Returns 0 if
+ * a snapshot was taken.
+ */
+int wal_snapshot(alarm_wal_t *wal, wal_walk_t walk, void *arg)
+{
+    wal_snapshot_t *snapshot;
+
+    pthread_mutex_lock(&wal->lock);
+    if (wal->rotating || wal->snapshot != NULL)
+    {
+        pthread_mutex_unlock(&wal->lock);
+        return -1;
+    }
+    // Records logged from now on go to a new segment, which the snapshot does not cover
+    wal->rotating = 1;
+    wal->rotate_at = wal->pending_size;
+    wal->appended = 0;
+    snapshot = calloc(1, sizeof(*snapshot));
+    if (snapshot == NULL)
+        errno_abort("Allocate snapshot");
+    snapshot->wal = wal;
+    snapshot->segment = ++wal->segment;
+    pthread_cond_signal(&wal->ready);
+    pthread_mutex_unlock(&wal->lock);
+
+    wal->snapshot_time = time(NULL);
+    walk(snapshot, arg);
+    wal->snapshot = snapshot;
+    return 0;
+}
+
+/*
+ * Fork the child that writes out the snapshot wal_snapshot took.
+ * Returns 0 if the child was started; otherwise the snapshot is
+ * dropped, and the log it would have retired is kept.
+ */
+int wal_snapshot_write(alarm_wal_t *wal)
+{
+    wal_snapshot_t *snapshot = wal->snapshot;
+    pid_t pid;
+
+    if (snapshot == NULL)
+        return -1;
+    wal->snapshot = NULL;
+    pid = fork();
+    if (pid == 0)
+        snapshot_write(wal, snapshot);
+    if (pid != -1)
+    {
+        wal->snapshot_pid = pid;
+        wal->snapshot_segment = snapshot->segment;
+    }
+    free(snapshot->data);
+    free(snapshot);
+    return pid == -1 ? -1 : 0;
+}
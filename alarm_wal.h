@@ -0,0 +1,125 @@
+#ifndef __alarm_wal_h
+#define __alarm_wal_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Persistence for the pending alarms: a write-ahead log of what
+ * the alarm monitor did, and periodic snapshots of everything it
+ * holds, in one directory.
+ *
+ * The log is a sequence of segment files, "wal.<n>", of compact
+ * binary records. Deadlines are written as CLOCK_REALTIME
+ * nanoseconds, since monotonic time does not survive a restart.
+ * wal_append only copies a record into a memory buffer; a writer
+ * thread writes whatever has gathered and makes it durable with
+ * one fdatasync (group commit), while the next batch gathers in a
+ * second buffer.
+ *
+ * A snapshot ("snapshot") holds one start record per pending
+ * alarm, and names the first log segment it does not cover. The
+ * caller takes one, holding whatever lock keeps its alarms still,
+ * with wal_snapshot: that starts a new log segment and copies the
+ * alarms into memory. Once it has let its alarms go, it calls
+ * wal_snapshot_write, which forks a child that writes the copy out,
+ * so that neither the disk nor the fork's copy of the process's
+ * page tables is waited for with the lock held. The child retires
+ * the segments the snapshot covers.
+ *
+ * On startup wal_open maps the snapshot and the log segments after
+ * it, and wal_replay hands every record to the caller in order. Records
+ * hold absolute deadlines and replaying one that already took
+ * effect changes nothing, so a crash at any point loses at most
+ * the last group commit.
+ */
+#define WAL_START 1
+#define WAL_CHANGE 2
+#define WAL_EXPIRE 3
+#define WAL_CANCEL 4
+#define WAL_REARM 5  /* A periodic alarm fired; "deadline" is its next one */
+
+#define WAL_BUFFER (1024 * 1024)          /* Bytes gathered per commit, at most */
+#define WAL_SNAPSHOT_BYTES (64ull << 20)  /* Log written before a snapshot is due */
+#define WAL_SNAPSHOT_INTERVAL 60          /* Seconds before a snapshot is due anyway */
+
+typedef struct wal_record_tag
+{
+    uint32_t checksum; /* FNV-1a of the rest of the record */
+    uint8_t type;      /* WAL_START, WAL_CHANGE, WAL_EXPIRE, WAL_CANCEL or WAL_REARM */
+    uint8_t length;    /* Message bytes after the record */
+    uint16_t reserved;
+    int32_t alarm_id;
+    int32_t group_id;
+    int64_t deadline;  /* CLOCK_REALTIME nanoseconds */
+    uint64_t period;   /* Nanoseconds between firings, 0 for a one-shot alarm */
+} wal_record_t;
+
+typedef struct wal_map_tag
+{
+    char *base;
+    size_t size;
+    int checked;  /* A log segment, rather than the snapshot */
+} wal_map_t;
+
+typedef struct alarm_wal_tag
+{
+    char dir[256];
+    int64_t clock_offset;  /* CLOCK_REALTIME minus CLOCK_MONOTONIC */
+    pthread_t writer;
+    pthread_mutex_t lock;  /* Protects everything below */
+    pthread_cond_t ready;  /* Something to write */
+    pthread_cond_t space;  /* The pending buffer has room, or a write finished */
+    char *pending;         /* Records gathering for the next commit */
+    char *writing;         /* Records the writer is committing */
+    size_t pending_size;
+    int busy;              /* The writer is committing */
+    int fd;                /* Current segment, writer only */
+    uint64_t segment;      /* Segment the pending records go to */
+    int rotating;          /* Switch segments after rotate_at bytes */
+    size_t rotate_at;
+    uint64_t oldest;       /* First segment not yet covered by a snapshot */
+    uint64_t appended;     /* Bytes logged since the last snapshot */
+    uint64_t logged;       /* Bytes logged since wal_start */
+    uint64_t durable;      /* How many of those a commit has finished */
+    time_t snapshot_time;  /* When the last snapshot was started */
+    struct wal_snapshot_tag *snapshot; /* Taken, and not yet handed to a child */
+    pid_t snapshot_pid;    /* Child writing a snapshot, or 0 */
+    uint64_t snapshot_segment;
+    wal_map_t *maps;       /* Files wal_open mapped for wal_replay */
+    size_t map_count;
+} alarm_wal_t;
+
+/*
+ * Called for every recovered record, oldest first; "deadline" is
+ * CLOCK_MONOTONIC nanoseconds, and "message" is not NUL-terminated.
+ */
+typedef void (*wal_apply_t)(void *arg, int type, int alarm_id, int group_id,
+                            uint64_t deadline, uint64_t period, const char *message,
+                            size_t length);
+
+typedef struct wal_snapshot_tag wal_snapshot_t;
+
+/*
+ * Called by wal_snapshot, with the caller's alarms held still;
+ * calls wal_snapshot_add once for every pending alarm.
+ */
+typedef void (*wal_walk_t)(wal_snapshot_t *snapshot, void *arg);
+
+size_t wal_open(alarm_wal_t *wal, const char *dir);
+long wal_replay(alarm_wal_t *wal, wal_apply_t apply, void *arg);
+void wal_start(alarm_wal_t *wal);
+void wal_append(alarm_wal_t *wal, int type, int alarm_id, int group_id, uint64_t deadline,
+                uint64_t period, const char *message);
+void wal_flush(alarm_wal_t *wal);
+void wal_sync(alarm_wal_t *wal);
+void wal_close(alarm_wal_t *wal);
+int wal_snapshot_due(alarm_wal_t *wal);
+int wal_snapshot(alarm_wal_t *wal, wal_walk_t walk, void *arg);
+int wal_snapshot_write(alarm_wal_t *wal);
+void wal_snapshot_add(wal_snapshot_t *snapshot, int alarm_id, int group_id, uint64_t deadline,
+                      uint64_t period, const char *message);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * alarm_wheel.c
+ *
+ * Hierarchical timing wheel used as the pending-alarm store. An
+ * entry lives on the level of the highest WHEEL_BITS-wide group
+ * of bits in which its expiry tick differs from the wheel's
+ * current tick, in the slot named by that group of its expiry
+ * tick. When the wheel reaches the start of that slot's span the
+ * slot is "cascaded": its entries are placed again, which moves
+ * each of them to a lower level, until they reach level 0 and
+ * expire. Entries too far out for the top level wait on the
+ * overflow list, which is cascaded every time the top level wraps.
+ */
+#include <string.h>
+#include "alarm_wheel.h"
+
+/*
+ * Push a node on the front of a slot (or other) list.
+ */
+static void wheel_link(wheel_node_t **head, wheel_node_t *node)
+{
+    node->next = *head;
+    if (node->next != NULL)
+        node->next->pprev = &node->next;
+    *head = node;
+    node->pprev = head;
+}
+
+/*
+ * Put a node on the list it belongs to, relative to wheel->now.
+ * This does not count the node; wheel_insert does that.
+ */
+static void wheel_place(alarm_wheel_t *wheel, wheel_node_t *node)
+{
+    uint64_t diff;
+    int level, slot;
+
+    if (node->expires <= wheel->now)
+    {
+        wheel_link(&wheel->due, node);
+        return;
+    }
+    diff = node->expires ^ wheel->now;
+    level = (63 - __builtin_clzll(diff)) / WHEEL_BITS;
+    if (level >= WHEEL_LEVELS)
+    {
+        wheel_link(&wheel->overflow, node);
+        return;
+    }
+    slot = (node->expires >> (level * WHEEL_BITS)) & WHEEL_MASK;
+    wheel_link(&wheel->slots[level][slot], node);
+    wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+/*
+ * Find the next tick at which the wheel has work to do, and the
+ * list that has to be processed then. Returns NULL if the wheel
+ * is empty.
+ */
+static wheel_node_t **wheel_next_event(alarm_wheel_t *wheel, uint64_t *tick)
+{
+    int level, slot, shift;
+
+    if (wheel->due != NULL)
+    {
+        *tick = wheel->now;
+        return &wheel->due;
+    }
+    for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+        if (wheel->occupied[level] == 0)
+            continue;
+        shift = level * WHEEL_BITS;
+        slot = __builtin_ctzll(wheel->occupied[level]);
+        *tick = (wheel->now >> (shift + WHEEL_BITS)) << (shift + WHEEL_BITS);
+        *tick |= (uint64_t)slot << shift;
+        return &wheel->slots[level][slot];
+    }
+    if (wheel->overflow != NULL)
+    {
+        shift = WHEEL_LEVELS * WHEEL_BITS;
+        *tick = ((wheel->now >> shift) + 1) << shift;
+        return &wheel->overflow;
+    }
+    return NULL;
+}
+
+void wheel_init(alarm_wheel_t *wheel, uint64_t now)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+/*
+ * Insert a node whose "expires" field has been set. A node that
+ * is already due goes on the due list, and is returned by the
+ * next wheel_advance.
+ */
+void wheel_insert(alarm_wheel_t *wheel, wheel_node_t *node)
+{
+    wheel_place(wheel, node);
+    wheel->count++;
+}
+
+/*
+ * Remove a node that is still held by the wheel. Removing a node
+ * that has already been returned by wheel_advance does nothing.
+ */
+void wheel_remove(alarm_wheel_t *wheel, wheel_node_t *node)
+{
+    wheel_node_t **first = &wheel->slots[0][0];
+    wheel_node_t **last = &wheel->slots[WHEEL_LEVELS - 1][WHEEL_MASK];
+    size_t index;
+
+    if (node->pprev == NULL)
+        return;
+    *node->pprev = node->next;
+    if (node->next != NULL)
+        node->next->pprev = node->pprev;
+
+    /*
+     * If the node was the last one in a slot, "pprev" points into
+     * the slot array itself, and the slot's bit has to go.
+     */
+    if (node->pprev >= first && node->pprev <= last && *node->pprev == NULL)
+    {
+        index = node->pprev - first;
+        wheel->occupied[index / WHEEL_SLOTS] &=
+            ~((uint64_t)1 << (index % WHEEL_SLOTS));
+    }
+    node->next = NULL;
+    node->pprev = NULL;
+    wheel->count--;
+}
+
+/*
+ * Report the next tick at which wheel_advance has something to do.
+ * This is exact for entries on level 0; for entries further out it
+ * is the tick at which they are moved down a level, which is never
+ * later than their expiry. Returns 0 if the wheel is empty.
+ */
+int wheel_next_tick(alarm_wheel_t *wheel, uint64_t *tick)
+{
+    return wheel_next_event(wheel, tick) != NULL;
+}
+
+/*
+ * Move the wheel forward to tick "now", and return every entry
+ * that expired on the way, in expiry order, linked through their
+ * "next" fields. Returned nodes no longer belong to the wheel.
+ */
+wheel_node_t *wheel_advance(alarm_wheel_t *wheel, uint64_t now)
+{
+    wheel_node_t *expired = NULL, **tail = &expired;
+    wheel_node_t **list, *node, *next;
+    uint64_t tick;
+    size_t index;
+
+    while ((list = wheel_next_event(wheel, &tick)) != NULL && tick <= now)
+    {
+        wheel->now = tick;
+        node = *list;
+        *list = NULL;
+        if (list != &wheel->due && list != &wheel->overflow)
+        {
+            index = list - &wheel->slots[0][0];
+            wheel->occupied[index / WHEEL_SLOTS] &=
+                ~((uint64_t)1 << (index % WHEEL_SLOTS));
+        }
+        for (; node != NULL; node = next)
+        {
+            next = node->next;
+            if (node->expires <= wheel->now)
+            {
+                node->pprev = NULL;
+                node->next = NULL;
+                *tail = node;
+                tail = &node->next;
+                wheel->count--;
+            }
+            else
+                wheel_place(wheel, node);
+        }
+    }
+    if (now > wheel->now)
+        wheel->now = now;
+    return expired;
+}
+
+/*
+ * Call "visit" for every entry held by the wheel, in no particular
+ * order, until it returns non-zero. Returns the value that stopped
+ * the walk, or 0. "visit" must not insert or remove entries.
+ */
+int wheel_walk(alarm_wheel_t *wheel,
+               int (*visit)(wheel_node_t *node, void *arg), void *arg)
+{
+    wheel_node_t *node;
+    int level, slot, status;
+
+    for (node = wheel->due; node != NULL; node = node->next)
+        if ((status = visit(node, arg)) != 0)
+            return status;
+    for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+        for (slot = 0; slot < WHEEL_SLOTS; slot++)
+        {
+            if ((wheel->occupied[level] & ((uint64_t)1 << slot)) == 0)
+                continue;
+            for (node = wheel->slots[level][slot]; node != NULL; node = node->next)
+                if ((status = visit(node, arg)) != 0)
+                    return status;
+        }
+    }
+    for (node = wheel->overflow; node != NULL; node = node->next)
+        if ((status = visit(node, arg)) != 0)
+            return status;
+    return 0;
+}
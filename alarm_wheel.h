@@ -0,0 +1,55 @@
+#ifndef __alarm_wheel_h
+#define __alarm_wheel_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A hierarchical timing wheel. Every level has WHEEL_SLOTS slots,
+ * and each slot of level "n" spans WHEEL_SLOTS^n ticks, so the
+ * default geometry covers 2^36 ticks before an entry has to wait
+ * on the overflow list. What a "tick" is (a second, a millisecond)
+ * is up to the caller: the wheel only compares tick numbers.
+ *
+ * Insert and remove are O(1). Advancing the wheel touches only the
+ * slots that actually hold entries: each entry is moved down at
+ * most once per level on its way to level 0, where it expires.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 6
+
+/*
+ * The wheel node is embedded in the caller's structure, and
+ * wheel_entry() gets back to the enclosing structure.
+ */
+typedef struct wheel_node_tag
+{
+    struct wheel_node_tag *next;
+    struct wheel_node_tag **pprev; /* Link that points at this node */
+    uint64_t expires;              /* Tick at which the entry is due */
+} wheel_node_t;
+
+#define wheel_entry(node, type, member) \
+    ((type *)((char *)(node) - offsetof(type, member)))
+
+typedef struct alarm_wheel_tag
+{
+    uint64_t now;                  /* Last tick the wheel advanced to */
+    size_t count;                  /* Entries held, including due ones */
+    uint64_t occupied[WHEEL_LEVELS]; /* Bit per non-empty slot */
+    wheel_node_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    wheel_node_t *overflow;        /* Beyond the reach of the top level */
+    wheel_node_t *due;             /* Inserted at or before "now" */
+} alarm_wheel_t;
+
+void wheel_init(alarm_wheel_t *wheel, uint64_t now);
+void wheel_insert(alarm_wheel_t *wheel, wheel_node_t *node);
+void wheel_remove(alarm_wheel_t *wheel, wheel_node_t *node);
+int wheel_next_tick(alarm_wheel_t *wheel, uint64_t *tick);
+wheel_node_t *wheel_advance(alarm_wheel_t *wheel, uint64_t now);
+int wheel_walk(alarm_wheel_t *wheel,
+               int (*visit)(wheel_node_t *node, void *arg), void *arg);
+
+#endif
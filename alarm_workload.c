@@ -0,0 +1,271 @@
+/*
+ * alarm_workload.c
+ *
+ * Generating, saving and loading benchmark workloads: see
+ * alarm_workload.h. A generated Change_Alarm or Cancel_Alarm only
+ * targets an alarm that, by the plan, is still at least
+ * CHANGE_MARGIN from expiring when it is submitted, so that it does
+ * not race with the expiry, and has not been cancelled; when the
+ * pick fails, a new alarm is started instead.
+ */
+#include <math.h>
+#include "errors.h"
+#include "alarm_parse.h"
+#include "alarm_workload.h"
+#include "alarm_time.h"
+
+#define CHANGE_MARGIN (50 * NSEC_PER_MSEC)
+
+void workload_defaults(workload_params_t *params)
+{
+    params->commands = 10000;
+    params->rate = 0;
+    params->groups = 4;
+    params->change_ratio = 0;
+    params->cancel_ratio = 0;
+    params->timeout_kind = TIMEOUT_UNIFORM;
+    params->timeout_a = 0.1;
+    params->timeout_b = 1.0;
+    params->hot_seconds = 0;
+    params->seed = 1;
+}
+
+/*
+ * Parse a timeout distribution: "fixed:T", "uniform:LO:HI",
+ * "exp:MEAN" or "skew:HI:K:P", in seconds. With "skew", a fraction
+ * P of the alarms are due on one of K whole seconds of the run,
+ * spread evenly up to HI, and the rest at any time up to HI.
+ * Returns 0 on success.
+ */
+int workload_parse_timeouts(workload_params_t *params, const char *text)
+{
+    double a, b;
+    int k;
+
+    if (sscanf(text, "fixed:%lf", &a) == 1 && a >= 0)
+        params->timeout_kind = TIMEOUT_FIXED;
+    else if (sscanf(text, "uniform:%lf:%lf", &a, &b) == 2 && a >= 0 && b >= a)
+    {
+        params->timeout_kind = TIMEOUT_UNIFORM;
+        params->timeout_b = b;
+    }
+    else if (sscanf(text, "exp:%lf", &a) == 1 && a > 0)
+        params->timeout_kind = TIMEOUT_EXPONENTIAL;
+    else if (sscanf(text, "skew:%lf:%d:%lf", &a, &k, &b) == 3 && a >= 1 && k >= 1 && k <= a &&
+             b >= 0 && b <= 1)
+    {
+        params->timeout_kind = TIMEOUT_SKEWED;
+        params->timeout_b = b;
+        params->hot_seconds = k;
+    }
+    else
+        return -1;
+    params->timeout_a = a;
+    return 0;
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static double random_unit(uint64_t *state)
+{
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * A timeout for a command submitted at "at" (nanoseconds into the
+ * run). Skewed deadlines are fixed points of the run, so the
+ * timeout that reaches one shrinks as the run goes on.
+ */
+static uint64_t random_timeout(const workload_params_t *params, uint64_t at, uint64_t *state)
+{
+    uint64_t hot;
+    double seconds;
+
+    switch (params->timeout_kind)
+    {
+    case TIMEOUT_FIXED:
+        seconds = params->timeout_a;
+        break;
+    case TIMEOUT_UNIFORM:
+        seconds = params->timeout_a + (params->timeout_b - params->timeout_a) * random_unit(state);
+        break;
+    case TIMEOUT_SKEWED:
+        seconds = params->timeout_a * random_unit(state);
+        if (random_unit(state) < params->timeout_b)
+        {
+            hot = (uint64_t)(params->timeout_a * (1 + next_random(state) % params->hot_seconds) /
+                             params->hot_seconds) * NSEC_PER_SEC;
+            if (hot > at)
+                return hot - at;
+        }
+        break;
+    default:
+        seconds = -params->timeout_a * log(1.0 - random_unit(state));
+        break;
+    }
+    return (uint64_t)(seconds * NSEC_PER_SEC);
+}
+
+static void workload_reserve(workload_t *workload, size_t count)
+{
+    workload->ops = realloc(workload->ops, count * sizeof(*workload->ops));
+    if (workload->ops == NULL)
+        errno_abort("Allocate workload");
+}
+
+void workload_generate(workload_t *workload, const workload_params_t *params)
+{
+    uint64_t state = params->seed | 1, *due;
+    workload_op_t *op;
+    double pick;
+    long i;
+    int id;
+
+    memset(workload, 0, sizeof(*workload));
+    workload_reserve(workload, params->commands);
+    due = calloc(params->commands + 1, sizeof(*due)); // Planned deadline by id, 0 once cancelled
+    if (due == NULL)
+        errno_abort("Allocate workload plan");
+
+    for (i = 0; i < params->commands; i++)
+    {
+        op = &workload->ops[workload->count++];
+        op->at = params->rate > 0 ? (uint64_t)(i / params->rate * NSEC_PER_SEC) : 0;
+        op->timeout = random_timeout(params, op->at, &state);
+        op->type = COMMAND_START;
+        if (workload->starts > 0 &&
+            (pick = random_unit(&state)) < params->change_ratio + params->cancel_ratio)
+        {
+            id = 1 + (int)(next_random(&state) % workload->starts);
+            if (due[id] >= op->at + CHANGE_MARGIN)
+                op->type = pick < params->change_ratio ? COMMAND_CHANGE : COMMAND_CANCEL;
+        }
+        if (op->type == COMMAND_START)
+            id = ++workload->starts;
+        op->alarm_id = id;
+        op->group_id = id % params->groups;
+        if (op->type == COMMAND_CANCEL)
+        {
+            op->timeout = 0;
+            op->group_id = 0;
+            workload->cancels++;
+            due[id] = 0;
+        }
+        else
+            due[id] = op->at + op->timeout;
+    }
+    workload->max_id = (int)workload->starts;
+    free(due);
+}
+
+/*
+ * Read a workload file. A line without an offset is submitted
+ * together with the line before it. Returns 0 on success, or -1
+ * with errno set.
+ */
+int workload_load(workload_t *workload, const char *path)
+{
+    char line[512], *rest;
+    size_t capacity = 1024;
+    uint64_t at = 0;
+    command_t command;
+    FILE *file;
+    long line_number = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+    memset(workload, 0, sizeof(*workload));
+    workload_reserve(workload, capacity);
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        if (line[0] >= '0' && line[0] <= '9')
+            at = strtoull(line, &rest, 10) * 1000;
+        else
+            rest = line;
+        rest += strspn(rest, " \t");
+        if (parse_command(rest, strlen(rest), &command) != 0)
+        {
+            fprintf(stderr, "%s:%ld: bad command\n", path, line_number);
+            continue;
+        }
+        // A periodic alarm never ends, so a run with one would never drain
+        if (command.type == COMMAND_STATS || command.type == COMMAND_PERIODIC)
+            continue;
+        if (workload->count == capacity)
+            workload_reserve(workload, capacity *= 2);
+        workload->ops[workload->count].at = at;
+        workload->ops[workload->count].timeout = command.timeout;
+        workload->ops[workload->count].type = command.type;
+        workload->ops[workload->count].alarm_id = command.alarm_id;
+        workload->ops[workload->count].group_id = command.group_id;
+        workload->count++;
+        if (command.type == COMMAND_START)
+            workload->starts++;
+        else if (command.type == COMMAND_CANCEL)
+        {
+            workload->ops[workload->count - 1].timeout = 0;
+            workload->ops[workload->count - 1].group_id = 0;
+            workload->cancels++;
+        }
+        if (command.alarm_id > workload->max_id)
+            workload->max_id = command.alarm_id;
+    }
+    fclose(file);
+    return 0;
+}
+
+/*
+ * Format a timeout in milliseconds, with microseconds after the
+ * point, which every alarm program accepts.
+ */
+char *workload_timeout_text(uint64_t ns, char *buf, size_t size)
+{
+    uint64_t us = ns / 1000;
+
+    snprintf(buf, size, "%llu.%03llums", (unsigned long long)(us / 1000),
+             (unsigned long long)(us % 1000));
+    return buf;
+}
+
+/*
+ * Write a workload file. Returns 0 on success, or -1 with errno
+ * set.
+ */
+int workload_save(const workload_t *workload, const char *path)
+{
+    const workload_op_t *op;
+    char timeout[32];
+    FILE *file;
+    size_t i;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        return -1;
+    for (i = 0; i < workload->count; i++)
+    {
+        op = &workload->ops[i];
+        if (op->type == COMMAND_CANCEL)
+        {
+            fprintf(file, "%llu Cancel_Alarm(%d)\n", (unsigned long long)(op->at / 1000),
+                    op->alarm_id);
+            continue;
+        }
+        fprintf(file, "%llu %s(%d): Group(%d) %s bench %d\n",
+                (unsigned long long)(op->at / 1000),
+                op->type == COMMAND_START ? "Start_Alarm" : "Change_Alarm",
+                op->alarm_id, op->group_id,
+                workload_timeout_text(op->timeout, timeout, sizeof(timeout)), op->alarm_id);
+    }
+    return fclose(file);
+}
@@ -0,0 +1,62 @@
+#ifndef __alarm_workload_h
+#define __alarm_workload_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A recorded benchmark workload: Start_Alarm, Change_Alarm and
+ * Cancel_Alarm commands, each with the time (from the start of the run) at
+ * which it is submitted. alarm_bench replays the same workload
+ * through every program it runs; a workload can be generated from a
+ * few parameters or read from a file. On disk a workload is one command per line, in the
+ * usual command syntax, after its submission offset in
+ * microseconds:
+ *
+ *      1500 Start_Alarm(3): Group(3) 250.000ms bench 3
+ */
+#define TIMEOUT_FIXED 0
+#define TIMEOUT_UNIFORM 1
+#define TIMEOUT_EXPONENTIAL 2
+#define TIMEOUT_SKEWED 3 /* Most deadlines on a few whole seconds */
+
+typedef struct workload_op_tag
+{
+    uint64_t at;      /* Submission offset, nanoseconds */
+    uint64_t timeout; /* Nanoseconds; 0 for a cancel */
+    int type;         /* COMMAND_START, COMMAND_CHANGE or COMMAND_CANCEL */
+    int alarm_id;
+    int group_id;
+} workload_op_t;
+
+typedef struct workload_tag
+{
+    workload_op_t *ops;
+    size_t count;
+    size_t starts;
+    size_t cancels;
+    int max_id;
+} workload_t;
+
+typedef struct workload_params_tag
+{
+    long commands;       /* Start, Change and Cancel commands */
+    double rate;         /* Commands per second, 0 to submit flat out */
+    int groups;          /* Group cardinality */
+    double change_ratio; /* Fraction of commands that are changes */
+    double cancel_ratio; /* Fraction of commands that are cancels */
+    int timeout_kind;    /* TIMEOUT_FIXED, TIMEOUT_UNIFORM, TIMEOUT_EXPONENTIAL or TIMEOUT_SKEWED */
+    double timeout_a;    /* Fixed value, lower bound, mean or skewed upper bound, seconds */
+    double timeout_b;    /* Upper bound, seconds, or skewed fraction on the hot seconds */
+    int hot_seconds;     /* Skewed: how many seconds the hot deadlines share */
+    uint64_t seed;
+} workload_params_t;
+
+void workload_defaults(workload_params_t *params);
+int workload_parse_timeouts(workload_params_t *params, const char *text);
+void workload_generate(workload_t *workload, const workload_params_t *params);
+int workload_load(workload_t *workload, const char *path);
+int workload_save(const workload_t *workload, const char *path);
+char *workload_timeout_text(uint64_t ns, char *buf, size_t size);
+
+#endif
@@ -13,82 +13,68 @@
 #include <pthread.h>
 #include <time.h>
 #include "errors.h"
+#include "alarm_heap.h"
+#include "alarm_hash.h"
+#include "alarm_time.h"
+#include "alarm_slab.h"
+#include "alarm_lockstat.h"
 
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
+ * The "alarm" structure now contains the CLOCK_MONOTONIC deadline
+ * (in nanoseconds) for each alarm, so that they can be
+ * sorted. Storing the requested timeout would not be
  * enough, since the "alarm thread" cannot tell how long it has
  * been on the list.
  */
 typedef struct alarm_tag
 {
-    struct alarm_tag *link;
-    int seconds;
-    time_t time; /* seconds from EPOCH */
+    heap_node_t position; // Slot in the alarm heap
+    uint64_t timeout; /* requested timeout, nanoseconds */
+    uint64_t time;    /* CLOCK_MONOTONIC deadline, nanoseconds */
     char message[64];
     int alarm_id;
     int group_number;
 } alarm_t;
 
+/*
+ * Pending alarms are kept in an indexed heap ordered by expiration
+ * time. Each alarm knows its slot, so a Change_Alarm can move it
+ * to its new place instead of leaving the order broken.
+ */
 pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
-alarm_t *alarm_list = NULL;
-time_t current_alarm = 0;
+slab_t alarm_slab; // Alarms are allocated by main and freed by the alarm thread
+pthread_cond_t alarm_cond;
+alarm_heap_t alarm_heap;
+alarm_hash_t alarm_index; // Pending alarms, by alarm_id
+uint64_t current_alarm = 0;
 
 /*
- * Insert alarm entry on list, in order.
+ * Insert alarm entry into the alarm heap.
  */
 void alarm_insert(alarm_t *alarm)
 {
     int status;
-    alarm_t **last, *next;
+    char timeout[32];
 
     /*
      * LOCKING PROTOCOL:
      * This routine requires that the caller have locked the
      * alarm_mutex!
      */
-    last = &alarm_list; // Points to the address that points to the alarm list
-    next = *last;       // Points to the first alarm or head of linked list
-
-    // Iterate through linked list
-    while (next != NULL)
-    {
-        // If the current alarm's time is >= to the given alarm...
-        if (next->alarm_id >= alarm->alarm_id)
-        {
-            // The new alarm's next alarm is set to the current alarm
-            alarm->link = next;
-
-            // The alarm prior is set to the alarm
-            *last = alarm;
-            // *last -> alarm -> next
-            break;
-        }
-        // Next iteration
-        last = &next->link;
-        next = next->link;
-    }
-    /*
-     * If we reached the end of the list, insert the new alarm
-     * there.  ("next" is NULL, and "last" points to the link
-     * field of the last item, or to the list header.)
-     */
-    if (next == NULL)
-    {
-        *last = alarm;
-        alarm->link = NULL;
-    }
+    heap_insert(&alarm_heap, &alarm->position, alarm->time);
 
-    printf("Alarm(%d) Inserted through Main Thread %lu Into Alarm List at %ld: Group(%d) %ld %s\n",
-           alarm->alarm_id, pthread_self(), alarm->time, alarm->group_number, alarm->seconds, alarm->message);
+    printf("Alarm(%d) Inserted through Main Thread %lu Into Alarm List at %ld: Group(%d) %s %s\n",
+           alarm->alarm_id, pthread_self(), (long)time(NULL), alarm->group_number,
+           format_timeout(alarm->timeout, timeout, sizeof(timeout)), alarm->message);
 
 #ifdef DEBUG
     printf("[list: ");
-    for (next = alarm_list; next != NULL; next = next->link)
-        printf("%d(%d)[\"%s\"] ", next->time,
-               next->time - time(NULL), next->message);
+    for (size_t i = 0; i < alarm_heap.count; i++)
+    {
+        alarm_t *next = heap_entry(alarm_heap.slots[i].node, alarm_t, position);
+        printf("%llu(%lld)[\"%s\"] ", (unsigned long long)next->time,
+               (long long)(next->time - monotonic_ns()), next->message);
+    }
     printf("]\n");
 #endif
     /*
@@ -114,8 +100,9 @@ void *alarm_thread(void *arg)
 {
     alarm_t *alarm;
     struct timespec cond_time;
-    time_t now;
-    int status, expired;
+    uint64_t now, next;
+    char timeout[32];
+    int status;
 
     /*
      * Loop forever, processing commands. The alarm thread will
@@ -123,21 +110,34 @@ void *alarm_thread(void *arg)
      * at the start -- it will be unlocked during condition
      * waits, so the main thread can insert alarms.
      */
-    status = pthread_mutex_lock(&alarm_mutex);
+    status = lockstat_mutex_lock(&alarm_mutex);
     if (status != 0)
         err_abort(status, "Lock mutex");
     while (1)
     {
+        now = monotonic_ns(); // Current time
+
+        // The heap root is always the earliest alarm, so expire from the top
+        while (alarm_heap.count > 0 && heap_min_key(&alarm_heap) <= now)
+        {
+            alarm = heap_entry(heap_pop(&alarm_heap), alarm_t, position);
+            hash_remove(&alarm_index, alarm->alarm_id);
+            printf("(%s) %s\n", format_timeout(alarm->timeout, timeout, sizeof(timeout)),
+                   alarm->message);
+            slab_free(&alarm_slab, alarm);
+        }
+
         /*
-         * If the alarm list is empty, wait until an alarm is
-         * added. Setting current_alarm to 0 informs the insert
-         * routine that the thread is not busy.
+         * If the heap is empty, wait until an alarm is added.
+         * Setting current_alarm to 0 informs the insert routine
+         * that the thread is not busy.
          */
-        current_alarm = 0;
-        while (alarm_list == NULL)
+        if (alarm_heap.count == 0)
         {
-            // WAIT until alarm is added to linked list
-            status = pthread_cond_wait(&alarm_cond, &alarm_mutex);
+            current_alarm = 0;
+
+            // WAIT until alarm is added to the heap
+            status = lockstat_cond_wait(&alarm_cond, &alarm_mutex);
             // NOTE: cond_wait does three things
             // 1. pthread_mutex_unlock(&alarm_mutex)
             // 2. wait for signal on alarm_cond(from other threads)
@@ -145,64 +145,31 @@ void *alarm_thread(void *arg)
 
             if (status != 0)
                 err_abort(status, "Wait on cond");
+            continue;
         }
 
-        alarm = alarm_list;       // 1. assign alarm to head of linked list
-        alarm_list = alarm->link; // 2. move to the NEXT node in linked list (head = head.next)
-
-        now = time(NULL); // Current time
-        expired = 0;      // Not expired initially not expired
-
-        // If alarm is not expired...
-        if (alarm->time > now)
-        {
+        next = heap_min_key(&alarm_heap);
 #ifdef DEBUG
-            printf("[waiting: %d(%d)\"%s\"]\n", alarm->time,
-                   alarm->time - time(NULL), alarm->message);
+        printf("[waiting: %llu(%lld)]\n", (unsigned long long)next,
+               (long long)(next - monotonic_ns()));
 #endif
-            cond_time.tv_sec = alarm->time;
-            cond_time.tv_nsec = 0;
-            current_alarm = alarm->time;
+        cond_time = ns_to_timespec(next);
+        current_alarm = next;
 
-            // While the alarm->time remains unchanged
-            // Ex. Adding a new alarm would would break this equality
-            while (current_alarm == alarm->time)
-            {
-                // Wait until alarm is expired
-                // This signal can be triggered if?:
-                // 1. A new alarm is added
-                // 2. The alarm expires
-                status = pthread_cond_timedwait(
-                    &alarm_cond, &alarm_mutex, &cond_time);
-
-                // When expired, set to expired and break out of loop
-                if (status == ETIMEDOUT)
-                {
-                    expired = 1;
-                    break;
-                }
-
-                // Any status other than ETIMEDOUT == an error in the program
-                if (status != 0)
-                    err_abort(status, "Cond timedwait");
-            }
-
-            // If not expired, insert the alarm back in to the linked list
-            if (!expired)
-                // Pass the pointer to the HEAD of the alarm list?
-                alarm_insert(alarm);
-        }
+        // While the earliest expiration time remains unchanged
+        // Ex. Adding or changing an earlier alarm would break this equality
+        while (current_alarm == next)
+        {
+            status = lockstat_cond_timedwait(
+                &alarm_cond, &alarm_mutex, &cond_time);
 
-        // If alarm is expired..
-        // 1. Change status to expired
-        else
-            expired = 1;
+            // When the root expires, go back and remove it
+            if (status == ETIMEDOUT)
+                break;
 
-        // Deallocate space used by alarm
-        if (expired)
-        {
-            printf("(%d) %s\n", alarm->seconds, alarm->message);
-            free(alarm);
+            // Any status other than ETIMEDOUT == an error in the program
+            if (status != 0)
+                err_abort(status, "Cond timedwait");
         }
     }
 }
@@ -214,7 +181,7 @@ void handle_invalid_request()
 }
 
 // Start_Alarm function
-void start_alarm(int alarm_id, int group_number, int seconds, const char *message)
+void start_alarm(int alarm_id, int group_number, uint64_t timeout, const char *message)
 {
 
     // If characters > 128, truncate it to 128
@@ -223,67 +190,90 @@ void start_alarm(int alarm_id, int group_number, int seconds, const char *messag
     truncated_message[128] = '\0';
 
     // Allocate memory for the new alarm
-    alarm_t *alarm = (alarm_t *)malloc(sizeof(alarm_t));
-    if (alarm == NULL)
-        errno_abort("Allocate alarm");
+    alarm_t *alarm = (alarm_t *)slab_alloc(&alarm_slab);
 
     // Initialize the alarm
-    alarm->link = NULL;
-    alarm->seconds = seconds;
-    alarm->time = time(NULL) + alarm->seconds;
+    alarm->timeout = timeout;
+    alarm->time = monotonic_ns() + alarm->timeout;
     strncpy(alarm->message, message, sizeof(alarm->message) - 1);
     alarm->message[sizeof(alarm->message) - 1] = '\0';
     alarm->alarm_id = alarm_id;
     alarm->group_number = group_number;
 
     // Lock the mutex before inserting the alarm
-    int status = pthread_mutex_lock(&alarm_mutex);
+    int status = lockstat_mutex_lock(&alarm_mutex);
     if (status != 0)
         err_abort(status, "Lock mutex");
 
-    // Insert the new alarm into the list
-    alarm_insert(alarm);
+    // Ids must be unique, since Change_Alarm finds alarms by id
+    if (hash_insert(&alarm_index, alarm_id, alarm) != 0)
+    {
+        printf("Alarm with id: %d already exists.\n", alarm_id);
+        slab_free(&alarm_slab, alarm);
+    }
+
+    // Insert the new alarm into the heap
+    else
+        alarm_insert(alarm);
 
     // Unlock the mutex after inserting the alarm
-    status = pthread_mutex_unlock(&alarm_mutex);
+    status = lockstat_mutex_unlock(&alarm_mutex);
     if (status != 0)
         err_abort(status, "Unlock mutex");
 }
 
-void change_alarm(int alarm_id, int group_number, int seconds, const char *message)
+// Find the pending alarm with the given id and group (caller holds alarm_mutex)
+alarm_t *alarm_find(int alarm_id, int group_number)
+{
+    alarm_t *alarm = hash_find(&alarm_index, alarm_id);
+
+    if (alarm != NULL && alarm->group_number != group_number)
+        return NULL;
+    return alarm;
+}
+
+void change_alarm(int alarm_id, int group_number, uint64_t timeout, const char *message)
 {
+    alarm_t *current;
+    char text[32];
+
     // Lock the mutex before modifying the alarm
-    int status = pthread_mutex_lock(&alarm_mutex);
+    int status = lockstat_mutex_lock(&alarm_mutex);
     if (status != 0)
         err_abort(status, "Lock mutex");
 
-    printf("alarm id: %d, group: %d, seconds: %d, message: %s\n", alarm_id, group_number, seconds, message);
-
-    // // Find the alarm in the list and update its properties
-    alarm_t *current = alarm_list;
+    printf("alarm id: %d, group: %d, seconds: %s, message: %s\n", alarm_id, group_number,
+           format_timeout(timeout, text, sizeof(text)), message);
 
-    printf("%d : current_alarm", current_alarm);
+    // Find the alarm in the heap and update its properties
+    current = alarm_find(alarm_id, group_number);
 
-    while (current != NULL)
+    if (current != NULL)
     {
-        printf("Looking for Alarm...");
-        if (current->alarm_id == alarm_id && current->group_number == group_number)
+        current->timeout = timeout;
+        current->time = monotonic_ns() + timeout;
+        strncpy(current->message, message, sizeof(current->message) - 1);
+        current->message[sizeof(current->message) - 1] = '\0';
+
+        // Move the alarm up or down the heap to its new expiration time
+        heap_update(&alarm_heap, &current->position, current->time);
+
+        // Wake the alarm thread if the alarm now expires before its wait ends
+        if (current_alarm == 0 || current->time < current_alarm)
         {
-            current->seconds = seconds;
-            current->time = time(NULL) + seconds;
-            strncpy(current->message, message, sizeof(current->message) - 1);
-            current->message[sizeof(current->message) - 1] = '\0';
-            break;
+            current_alarm = current->time;
+            status = pthread_cond_signal(&alarm_cond);
+            if (status != 0)
+                err_abort(status, "Signal cond");
         }
-        current = current->link;
     }
 
     // // If no alarms or matching alarm does not exist, return error message
-    if (current == NULL)
+    else
         printf("Alarm with id: %d and group_number: %d  does not exist.\n", alarm_id, group_number);
 
     // Unlock the mutex after modifying the alarm
-    status = pthread_mutex_unlock(&alarm_mutex);
+    status = lockstat_mutex_unlock(&alarm_mutex);
     if (status != 0)
         err_abort(status, "Unlock mutex");
 }
@@ -294,6 +284,22 @@ int main(int argc, char *argv[])
     char line[129];
     alarm_t *alarm;
     pthread_t thread;
+    pthread_condattr_t cond_attr;
+
+    // Timed waits are measured on CLOCK_MONOTONIC, the same clock as the deadlines
+    status = pthread_condattr_init(&cond_attr);
+    if (status != 0)
+        err_abort(status, "Init cond attr");
+    status = pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    if (status != 0)
+        err_abort(status, "Set cond clock");
+    status = pthread_cond_init(&alarm_cond, &cond_attr);
+    if (status != 0)
+        err_abort(status, "Init cond");
+    lockstat_init(); // Before any thread is created
+    heap_init(&alarm_heap);
+    slab_init(&alarm_slab, "alarm", sizeof(alarm_t));
+    hash_init(&alarm_index);
 
     // The thread runs the alarm_thread function
     status = pthread_create(
@@ -315,37 +321,42 @@ int main(int argc, char *argv[])
         // If Start_Alarm
         if (strncmp(line, "Start_Alarm", 11) == 0)
         {
-            int seconds, alarm_id, group_number;
-            char message[129];
+            int alarm_id, group_number;
+            uint64_t timeout;
+            char text[32], message[129];
 
             // Parse the Start_Alarm request and ensure all input are correct
-            if (sscanf(line, "Start_Alarm(%d): Group(%d) %d %128[^\n]",
-                       &alarm_id, &group_number, &seconds, message) < 4)
+            // The timeout is seconds (possibly fractional) or milliseconds with an "ms" suffix
+            if (sscanf(line, "Start_Alarm(%d): Group(%d) %31s %128[^\n]",
+                       &alarm_id, &group_number, text, message) < 4 ||
+                parse_timeout(text, &timeout) != 0)
             {
                 fprintf(stderr, "Faulty Start_Alarm request. Please try again\n");
                 continue;
             }
 
             // If all inputs are valid, call the Start_Alarm function
-            start_alarm(alarm_id, group_number, seconds, message);
+            start_alarm(alarm_id, group_number, timeout, message);
         }
 
         else if (strncmp(line, "Change_Alarm", 11) == 0)
         {
             // Same setup as Start Alarm
-            int alarm_id, group_number, seconds;
-            char message[129];
+            int alarm_id, group_number;
+            uint64_t timeout;
+            char text[32], message[129];
 
             // Parse the Change_Alarm request
-            if (sscanf(line, "Change_Alarm(%d): Group(%d) %d %128[^\n]",
-                       &alarm_id, &group_number, &seconds, message) < 4)
+            if (sscanf(line, "Change_Alarm(%d): Group(%d) %31s %128[^\n]",
+                       &alarm_id, &group_number, text, message) < 4 ||
+                parse_timeout(text, &timeout) != 0)
             {
                 fprintf(stderr, "Faulty Change_Alarm request. Please try again\n");
                 continue;
             }
 
             // If all inputs are valid, call the change_alarm function
-            change_alarm(alarm_id, group_number, seconds, message);
+            change_alarm(alarm_id, group_number, timeout, message);
         }
 
         // Else invalid input
@@ -13,404 +13,1605 @@
 #include <pthread.h>
 #include <time.h>
 #include "errors.h"
+#include "alarm_heap.h"
+#include "alarm_hash.h"
+#include "alarm_group.h"
+#include "alarm_time.h"
+#include "alarm_slab.h"
+#include "alarm_arena.h"
+#include "alarm_queue.h"
+#include "alarm_log.h"
+#include "alarm_parse.h"
+#include "alarm_histogram.h"
+#include "alarm_lockstat.h"
+#include "alarm_pool.h"
+#include "alarm_wal.h"
+#include "alarm_server.h"
 #include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
-void *display_thread(void *arg);
-void create_display_thread(int group_id);
+uint64_t display_pass(pool_job_t *work);
+struct alarm_tag;
+struct display_job_tag *assign_alarm_to_display_job(int group_id);
+struct display_job_tag *display_job_create(int group_id, int alarm_count);
+void display_job_release(int group_id);
 
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
+ * The "alarm" structure now contains the CLOCK_MONOTONIC deadline
+ * (in nanoseconds) for each alarm, so that they can be
+ * sorted. Storing the requested timeout would not be
  * enough, since the "alarm thread" cannot tell how long it has
  * been on the list.
+ *
+ * Only what expiry, lookup and the display pass touch is kept in
+ * the structure itself; the message text, which is read only when
+ * an alarm is printed, lives in message_arena. That takes an alarm
+ * from 176 bytes to 56.
+ *
+ * A periodic alarm (Start_Periodic_Alarm) is not removed when it
+ * fires: the monitor moves its deadline on by one period and sifts
+ * it down the heap in place, so it keeps its allocation, its index
+ * entry and its group link for as long as it lives.
  */
 typedef struct alarm_tag
 {
-    struct alarm_tag *link;
-    int seconds;
+    uint64_t time;        /* CLOCK_MONOTONIC deadline, nanoseconds */
+    uint64_t period;      /* Nanoseconds between firings, 0 for a one-shot alarm */
+    heap_node_t position; // Slot in the alarm heap
+    group_node_t member;  // Link in its group's list; once expired, in the monitor's batch
     int alarm_id;
     int group_id;
-    int type;               // 0 for Start_Alarm, 1 for Change_Alarm
-    time_t time;            /* seconds from EPOCH */
-    char message[129];      // Increased size to 128 characters
-    int assigned_to_thread; // 0: not assigned, 1: assigned
+    arena_ref_t message;  // Text in message_arena
 } alarm_t;
 
-typedef struct change_alarm_tag
+/*
+ * Start_Alarm and Change_Alarm commands are handed to the alarm
+ * monitor that owns the alarm as requests, and that monitor is the
+ * only thread that changes its alarm heap and index.
+ */
+#define REQUEST_START 0
+#define REQUEST_CHANGE 1
+#define REQUEST_EXIT 2 // End of input: flush the output and exit
+#define REQUEST_CANCEL 3
+#define REQUEST_SUPERSEDED 4 // A change overtaken by a later one in the same batch
+
+typedef struct request_tag
 {
-    struct change_alarm_tag *link;
+    queue_node_t link;
+    int type;            // REQUEST_START, REQUEST_CHANGE, REQUEST_CANCEL, REQUEST_EXIT, ...
     int alarm_id;
     int group_id;
-    time_t time;
-    char message[129];
-} change_alarm_t;
+    arena_ref_t message; // Text in message_arena, handed over to the alarm
+    uint64_t time;       /* CLOCK_MONOTONIC deadline, nanoseconds */
+    uint64_t period;     // Start: 0 for a one-shot alarm; change: the period if the alarm has one
+    pthread_t submitter; // Thread that read the command
+    server_ticket_t *ticket; // Reply a client is waiting for, or NULL
+
+    // What applying the request did, for the monitor to report once alarm_list_sem is released
+    int event;            // EVENT_INSERTED, EVENT_EXISTS, EVENT_CHANGED, EVENT_CANCELLED, ...
+    arena_ref_t replaced; // Text a changed alarm had before
+    int left_group;       // Group a changed alarm had before
+    alarm_t *cancelled;   // Alarm a cancel unlinked, freed once reported
+} request_t;
 
-typedef struct display_thread_info_tag
+/*
+ * A display job prints the pending alarms of one group every
+ * DISPLAY_PERIOD, until the group has none left. Jobs are not
+ * threads: they run on display_pool, a fixed set of workers, so
+ * any number of groups can be displayed. Between passes a job is
+ * a recurring timer event on the pool's wheel; passes that fall in
+ * the same DISPLAY_TICK run as one batch, from one wakeup. Each job takes up to
+ * DISPLAY_ALARMS alarms of its group; the alarm after that starts
+ * another job for the group. The monitors create and assign jobs,
+ * whatever expires an alarm gives its slot back, and a job
+ * finishes itself, all under display_lock. A pass holds
+ * display_lock while it takes the lock of each monitor in turn; a
+ * monitor never takes display_lock while it holds its own lock, so
+ * the two cannot deadlock.
+ */
+#define DISPLAY_PERIOD (5 * NSEC_PER_SEC)
+#define DISPLAY_ALARMS 2
+#define DISPLAY_TICK (100 * NSEC_PER_MSEC)
+
+typedef struct display_job_tag
 {
-    pthread_t thread_id;
+    pool_job_t work;
     int group_id;
-    int active;      // 0: inactive, 1: active
-    int alarm_count; // Number of alarms assigned to this thread
-} display_thread_info_t;
+    int alarm_count;               // Alarms assigned to this job
+    uint64_t due;                  // When the current pass was meant to run
+    struct display_job_tag *next;  // Next job of the same group
+} display_job_t;
+
+pool_t display_pool;
+pthread_mutex_t display_lock = PTHREAD_MUTEX_INITIALIZER; // Guards display_jobs and job alarm counts
+alarm_hash_t display_jobs; // First display job of each group, by group_id
+
+/*
+ * The pending alarms are split by alarm_id into monitor_count
+ * shards (-m), each with its own heap, index, group lists, request
+ * queue and lock, and its own monitor thread, so that expiry and
+ * request handling run on as many cores as there are shards. Every
+ * request for an alarm goes to the shard that owns its id; a group
+ * has members in every shard.
+ *
+ * A monitor sleeps in epoll_wait on two descriptors: a timerfd
+ * armed for the earliest deadline in its shard, and an eventfd that
+ * the main thread writes when it queues a request for it. The first
+ * monitor also watches monitor_signal, and takes the snapshots.
+ */
+#define MONITORS_MAX 64
+
+typedef struct monitor_tag
+{
+    sem_t alarm_list_sem;         // Semaphore for everything below but the queue
+    alarm_heap_t alarm_heap;      // Pending alarms, ordered by expiration time
+    alarm_hash_t alarm_index;     // Pending alarms, by alarm_id
+    group_index_t group_index;    // Pending alarms, by group_id, for the display passes
+    alarm_queue_t request_queue;  // Requests not yet seen by the monitor
+    uint64_t current_alarm;       // Deadline the timer is armed for, 0 if disarmed
+    alarm_hash_t latest_change;   // Last change of each alarm_id in the batch being taken
+    atomic_int chunks_pending;    // Expiry chunks handed to expiry_pool and not yet done
+    sem_t chunks_done;            // Posted by the last of them
+    int epoll;
+    int timer;
+    int event;
+    pthread_t thread;
+} monitor_t;
+
+monitor_t monitors[MONITORS_MAX];
+int monitor_count = 1;
+atomic_int monitors_running; // Monitors that have not yet seen their REQUEST_EXIT
+int monitor_signal; // SIGUSR1: report the lateness statistics
+
+/*
+ * The shard that owns an alarm_id. The multiplier spreads runs of
+ * consecutive ids over every shard.
+ */
+#define monitor_of(alarm_id) (&monitors[(uint32_t)(alarm_id) * 2654435761u % monitor_count])
+
+/*
+ * Requests are allocated by the main thread and freed by the
+ * monitor, and alarms come and go in the monitor, many times a
+ * second; slabs keep that off the general-purpose heap.
+ */
+slab_t alarm_slab;
+slab_t request_slab;
+slab_t display_slab;
 
-#define MAX_DISPLAY_THREADS 10
-display_thread_info_t display_threads[MAX_DISPLAY_THREADS];
+alarm_arena_t message_arena; // Message text of alarms and change requests
 
-// pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
-alarm_t *alarm_list = NULL;
-change_alarm_t *change_alarm_list = NULL;
-time_t current_alarm = 0;
+#define message_text(ref) arena_text(&message_arena, (ref))
 
-sem_t alarm_list_sem;  // Semaphore for alarm list
-sem_t change_list_sem; // Semaphore for change alarm list
+/*
+ * How late each alarm expired: the time from its deadline to the
+ * moment the monitor removed it. Every thread that expires alarms
+ * records into a histogram of its own, and the "Stats" command and
+ * SIGUSR1 add them up.
+ */
+histogram_set_t lateness_set;
 
 /*
- * Insert alarm entry on list, in order.
+ * Expiring an alarm (logging it, releasing its text and freeing it)
+ * costs far more than detaching it, so when a pass finds more than
+ * EXPIRY_CHUNK alarms due the monitor splits them into chunks of
+ * EXPIRY_CHUNK, keeps the last chunk for itself and hands the rest
+ * to expiry_pool, whose workers balance them between themselves by
+ * stealing (see alarm_pool.h). The monitor waits for every chunk
+ * before it reports its requests, so an alarm's expiry is always
+ * logged before anything later done with its id. With -e 0 the
+ * monitor expires every batch alone.
  */
-void alarm_insert(alarm_t *alarm)
+#define EXPIRY_CHUNK 1024
+
+typedef struct expiry_chunk_tag
 {
-    int status;
-    alarm_t **last, *next;
+    pool_job_t work;
+    group_node_t *first; // Expired alarms, linked through member
+    monitor_t *monitor;  // Waiting for the chunk
+} expiry_chunk_t;
 
-    sem_wait(&alarm_list_sem); // Wait on the semaphore before accessing alarm_list
+pool_t expiry_pool;
+int expiry_workers = -1; // -e; -1 for one per online CPU, 0 for none
 
-    /*
-     * LOCKING PROTOCOL:
-     *
-     * This routine requires that the caller have locked the
-     * alarm_mutex!
-     */
-    last = &alarm_list;
-    next = *last;
-    while (next != NULL)
+/*
+ * With -p, what the monitor does is logged to a write-ahead log
+ * (see alarm_wal.h) in the directory given, and the pending alarms
+ * are rebuilt from it on the next start. Each monitor logs its
+ * batch in phase two. The first one copies snapshots out in phase
+ * one, holding every monitor's lock, so that no alarm can change
+ * under it, and forks the child that writes a copy out only once
+ * it has let them all go; every record about one alarm comes from
+ * the one monitor that owns it, in order, so replaying the log over
+ * the snapshot still leaves each alarm as its last record says.
+ */
+alarm_wal_t wal;
+int persist = 0;
+
+alarm_server_t server; // With -s; see client_line
+
+/*
+ * Every line the program prints is an event record handed to the
+ * log writer thread (see alarm_log.h), which formats it with
+ * format_event.
+ */
+#define EVENT_PROMPT 0
+#define EVENT_INSERTED 1
+#define EVENT_EXISTS 2
+#define EVENT_CHANGE_REQUEST 3
+#define EVENT_CHANGED 4
+#define EVENT_INVALID_CHANGE 5
+#define EVENT_REMOVED 6
+#define EVENT_ASSIGNED 7
+#define EVENT_DISPLAY_CREATED 8
+#define EVENT_PRINTED 9
+#define EVENT_DISPLAY_EXIT 10
+#define EVENT_STATS 11 // A lateness report: values, not a message
+#define EVENT_CANCELLED 12
+#define EVENT_INVALID_CANCEL 13
+#define EVENT_FIRED 14 // A periodic alarm went off and was re-armed
+
+/*
+ * A lateness report travels as one record of values, so that
+ * nothing is printed between its lines: the alarm count, then the
+ * mean, the maximum and five percentiles in nanoseconds.
+ */
+#define LATENESS_FIELDS 8
+
+size_t format_event(const log_record_t *event, char *buf, size_t size, int *fd)
+{
+    void *thread = (void *)event->thread;
+    long at = (long)event->at;
+    const uint64_t *lateness = event->values;
+    int length = 0;
+
+    switch (event->event)
     {
-        if (next->time >= alarm->time)
-        {
-            alarm->link = next;
-            *last = alarm;
-            break;
-        }
-        last = &next->link;
-        next = next->link;
+    case EVENT_PROMPT:
+        length = snprintf(buf, size, "Alarm> ");
+        break;
+    case EVENT_INSERTED:
+        length = snprintf(buf, size, "Alarm(%d) Inserted by Main Thread %p Into Alarm List at %ld: Group(%d) %s\n",
+                          event->alarm_id, thread, at, event->group_id, event->message);
+        break;
+    case EVENT_EXISTS:
+        *fd = 2;
+        length = snprintf(buf, size, "Alarm(%d) already exists\n", event->alarm_id);
+        break;
+    case EVENT_CHANGE_REQUEST:
+        length = snprintf(buf, size, "Change Alarm Request (%d) Inserted by Main Thread %p into Change Alarm List at %ld: Group(%d) %s\n",
+                          event->alarm_id, thread, at, event->group_id, event->message);
+        break;
+    case EVENT_CHANGED:
+        length = snprintf(buf, size, "Alarm Monitor Thread %p Has Changed Alarm(%d) at %ld: Group(%d) %s\n",
+                          thread, event->alarm_id, at, event->group_id, event->message);
+        break;
+    case EVENT_INVALID_CHANGE:
+        length = snprintf(buf, size, "Invalid Change Alarm Request(%d) at %ld: Group(%d) %s\n",
+                          event->alarm_id, at, event->group_id, event->message);
+        break;
+    case EVENT_REMOVED:
+        length = snprintf(buf, size, "Alarm Monitor Thread %p Has Removed Alarm(%d) at %ld: Group(%d) %s\n",
+                          thread, event->alarm_id, at, event->group_id, event->message);
+        break;
+    case EVENT_ASSIGNED:
+        length = snprintf(buf, size, "Main Thread %p Assigned to Display Alarm(%d) at %ld: Group(%d) %s\n",
+                          thread, event->alarm_id, at, event->group_id, event->message);
+        break;
+    case EVENT_DISPLAY_CREATED:
+        length = snprintf(buf, size, "Main Thread Created New Display Alarm Thread %p For Alarm(%d) at %ld: Group(%d) %s\n",
+                          thread, event->alarm_id, at, event->group_id, event->message);
+        break;
+    case EVENT_PRINTED:
+        length = snprintf(buf, size, "Alarm (%d) Printed by Alarm Display Thread %p at %ld: Group(%d) %s\n",
+                          event->alarm_id, thread, at, event->group_id, event->message);
+        break;
+    case EVENT_DISPLAY_EXIT:
+        length = snprintf(buf, size, "No More Alarms in Group(%d): Display Thread %p exiting at %ld\n",
+                          event->group_id, thread, at);
+        break;
+    case EVENT_STATS:
+        length = snprintf(buf, size,
+                          "Lateness: %llu alarms expired, mean %.3f ms, max %.3f ms\n"
+                          "Lateness ms: p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f p99.99 %.3f\n",
+                          (unsigned long long)lateness[0], (double)lateness[1] / NSEC_PER_MSEC,
+                          (double)lateness[2] / NSEC_PER_MSEC, (double)lateness[3] / NSEC_PER_MSEC,
+                          (double)lateness[4] / NSEC_PER_MSEC, (double)lateness[5] / NSEC_PER_MSEC,
+                          (double)lateness[6] / NSEC_PER_MSEC, (double)lateness[7] / NSEC_PER_MSEC);
+        break;
+    case EVENT_CANCELLED:
+        length = snprintf(buf, size, "Alarm Monitor Thread %p Has Cancelled Alarm(%d) at %ld: Group(%d) %s\n",
+                          thread, event->alarm_id, at, event->group_id, event->message);
+        break;
+    case EVENT_INVALID_CANCEL:
+        length = snprintf(buf, size, "Invalid Cancel Alarm Request(%d) at %ld\n",
+                          event->alarm_id, at);
+        break;
+    case EVENT_FIRED:
+        length = snprintf(buf, size, "Alarm Monitor Thread %p Has Fired Periodic Alarm(%d) at %ld: Group(%d) %s\n",
+                          thread, event->alarm_id, at, event->group_id, event->message);
+        break;
     }
-    /*
-     * If we reached the end of the list, insert the new alarm
-     * there.  ("next" is NULL, and "last" points to the link
-     * field of the last item, or to the list header.)
-     */
-    if (next == NULL)
+    return length < 0 ? 0 : (size_t)length;
+}
+
+/*
+ * Tell an alarm monitor to look at its request queue. The eventfd counter absorbs any number of wakes that
+ * arrive before the monitor gets to them.
+ */
+void monitor_wake(monitor_t *monitor)
+{
+    uint64_t one = 1;
+
+    if (write(monitor->event, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        errno_abort("Wake alarm monitor");
+}
+
+/*
+ * Arm the monitor's timer for the earliest pending deadline, or
+ * disarm it when nothing is pending, so that an idle monitor never
+ * wakes. The caller must hold the monitor's alarm_list_sem.
+ */
+void monitor_arm(monitor_t *monitor)
+{
+    struct itimerspec deadline = {{0, 0}, {0, 0}};
+
+    monitor->current_alarm = 0;
+    if (monitor->alarm_heap.count > 0)
     {
-        *last = alarm;
-        alarm->link = NULL;
+        monitor->current_alarm = heap_min_key(&monitor->alarm_heap);
+        deadline.it_value = ns_to_timespec(monitor->current_alarm);
     }
+    if (timerfd_settime(monitor->timer, TFD_TIMER_ABSTIME, &deadline, NULL) == -1)
+        errno_abort("Arm alarm monitor timer");
+}
 
-    sem_post(&alarm_list_sem); // Post to the semaphore after modifying alarm_list
+/*
+ * Create the shards and the descriptors their monitors wait on.
+ */
+void monitor_init(void)
+{
+    struct epoll_event event;
+    monitor_t *monitor;
+    sigset_t signals;
+    int status;
+
+    // Every thread created from here on inherits the blocked mask, so only the signalfd sees SIGUSR1
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    status = pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if (status != 0)
+        err_abort(status, "Block monitor signals");
+    monitor_signal = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (monitor_signal == -1)
+        errno_abort("Create alarm monitor signalfd");
 
-    printf("Alarm(%d) Inserted by Main Thread %p Into Alarm List at %ld: Group(%d) %s\n",
-           alarm->alarm_id, pthread_self(), (long)time(NULL), alarm->group_id, alarm->message);
+    for (int i = 0; i < monitor_count; i++)
+    {
+        monitor = &monitors[i];
+        sem_init(&monitor->alarm_list_sem, 0, 1);
+        heap_init(&monitor->alarm_heap);
+        hash_init(&monitor->alarm_index);
+        group_index_init(&monitor->group_index);
+        queue_init(&monitor->request_queue);
+        monitor->current_alarm = 0;
+        hash_init(&monitor->latest_change);
+        atomic_init(&monitor->chunks_pending, 0);
+        sem_init(&monitor->chunks_done, 0, 0);
+
+        monitor->epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (monitor->epoll == -1)
+            errno_abort("Create alarm monitor epoll");
+        monitor->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (monitor->timer == -1)
+            errno_abort("Create alarm monitor timer");
+        monitor->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (monitor->event == -1)
+            errno_abort("Create alarm monitor event");
 
-    pthread_cond_signal(&alarm_cond);
+        event.events = EPOLLIN;
+        event.data.fd = monitor->timer;
+        if (epoll_ctl(monitor->epoll, EPOLL_CTL_ADD, monitor->timer, &event) == -1)
+            errno_abort("Watch alarm monitor timer");
+        event.data.fd = monitor->event;
+        if (epoll_ctl(monitor->epoll, EPOLL_CTL_ADD, monitor->event, &event) == -1)
+            errno_abort("Watch alarm monitor event");
+        if (i > 0)
+            continue;
+        event.data.fd = monitor_signal;
+        if (epoll_ctl(monitor->epoll, EPOLL_CTL_ADD, monitor_signal, &event) == -1)
+            errno_abort("Watch alarm monitor signals");
+    }
+    atomic_store(&monitors_running, monitor_count);
+}
 
+/*
+ * Print the merged lateness histogram. Any thread may call this.
+ */
+void report_lateness(void)
+{
+    histogram_snapshot_t snapshot;
+    uint64_t lateness[LATENESS_FIELDS];
+
+    histogram_merge(&lateness_set, &snapshot);
+    lateness[0] = snapshot.count;
+    lateness[1] = snapshot.count > 0 ? snapshot.sum / snapshot.count : 0;
+    lateness[2] = snapshot.max;
+    lateness[3] = histogram_percentile(&snapshot, 0.5);
+    lateness[4] = histogram_percentile(&snapshot, 0.9);
+    lateness[5] = histogram_percentile(&snapshot, 0.99);
+    lateness[6] = histogram_percentile(&snapshot, 0.999);
+    lateness[7] = histogram_percentile(&snapshot, 0.9999);
+    log_values(EVENT_STATS, pthread_self(), lateness, LATENESS_FIELDS);
+}
+
+/*
+ * Hand a request to the alarm monitor that owns its alarm. This
+ * never waits for the monitor: the request goes on a lock-free
+ * queue, and the monitor is only woken if the queue was empty,
+ * since otherwise a wake is already on its way. The request
+ * belongs to the monitor as soon as it is queued.
+ */
+void submit_request(request_t *request)
+{
+    monitor_t *monitor = monitor_of(request->alarm_id);
+
+    request->submitter = pthread_self();
+    if (queue_push(&monitor->request_queue, &request->link))
+        monitor_wake(monitor);
+}
+
+/*
+ * Apply a Start_Alarm or Start_Periodic_Alarm request: insert a
+ * new alarm into the alarm heap, and index it by id, unless an
+ * alarm with the same id is already pending. The caller must hold
+ * the monitor's alarm_list_sem; the outcome is left in the request
+ * for report_request, which also gives the alarm a display job.
+ */
+void alarm_insert(monitor_t *monitor, request_t *request)
+{
+    alarm_t *alarm = (alarm_t *)slab_alloc(&alarm_slab);
 #ifdef DEBUG
-    printf("[list: ");
-    for (next = alarm_list; next != NULL; next = next->link)
-        printf("%d(%d)[\"%s\"] ", next->time,
-               next->time - time(NULL), next->message);
-    printf("]\n");
+    alarm_t *next;
 #endif
-    /*
-     * Wake the alarm thread if it is not busy (that is, if
-     * current_alarm is 0, signifying that it's waiting for
-     * work), or if the new alarm comes before the one on
-     * which the alarm thread is waiting.
-     */
-    if (current_alarm == 0 || alarm->time < current_alarm)
+
+    alarm->alarm_id = request->alarm_id;
+    alarm->group_id = request->group_id;
+    alarm->time = request->time;
+    alarm->period = request->period;
+    if (hash_insert(&monitor->alarm_index, alarm->alarm_id, alarm) != 0)
     {
-        current_alarm = alarm->time;
-        status = pthread_cond_signal(&alarm_cond);
-        if (status != 0)
-            err_abort(status, "Signal cond");
+        request->event = EVENT_EXISTS;
+        slab_free(&alarm_slab, alarm);
+        return;
+    }
+    // The alarm shares the request's text, which stays valid until the request is reported
+    alarm->message = request->message;
+    heap_insert(&monitor->alarm_heap, &alarm->position, alarm->time);
+    group_add(&monitor->group_index, alarm->group_id, &alarm->member);
+    request->event = EVENT_INSERTED;
+
+#ifdef DEBUG
+    fprintf(stderr, "[list: ");
+    for (size_t i = 0; i < monitor->alarm_heap.count; i++)
+    {
+        next = heap_entry(monitor->alarm_heap.slots[i].node, alarm_t, position);
+        fprintf(stderr, "%llu(%lld)[\"%s\"] ", (unsigned long long)next->time,
+               (long long)(next->time - monotonic_ns()), message_text(next->message));
+    }
+    fprintf(stderr, "]\n");
+#endif
+}
+
+/*
+ * Apply a Change_Alarm request. A periodic alarm stays periodic:
+ * the new timeout becomes its period, and its schedule is anchored
+ * afresh at the change, so a zero timeout is refused for it. The
+ * caller must hold the monitor's alarm_list_sem; the outcome is
+ * left in the request for report_request, which also moves the
+ * alarm's display slot to its new group.
+ */
+void alarm_change(monitor_t *monitor, request_t *request)
+{
+    // Look the Alarm_ID up in the index and apply changes
+    alarm_t *alarm = hash_find(&monitor->alarm_index, request->alarm_id);
+    if (alarm != NULL && (alarm->period == 0 || request->period != 0))
+    {
+        if (alarm->group_id != request->group_id)
+        {
+            group_remove(&monitor->group_index, alarm->group_id, &alarm->member);
+            group_add(&monitor->group_index, request->group_id, &alarm->member);
+        }
+        request->left_group = alarm->group_id;
+        alarm->group_id = request->group_id;
+        alarm->time = request->time;
+        if (alarm->period == 0)
+            request->period = 0;
+        alarm->period = request->period;
+        // The alarm takes over the request's text; the old text is released once reported
+        request->replaced = alarm->message;
+        alarm->message = request->message;
+
+        // Move the alarm up or down the heap to its new expiration time
+        heap_update(&monitor->alarm_heap, &alarm->position, alarm->time);
+        request->event = EVENT_CHANGED;
+    }
+    // If there was no corresponding alarm found, or it cannot take the change, then we print error
+    else
+        request->event = EVENT_INVALID_CHANGE;
+}
+
+/*
+ * Apply a Cancel_Alarm request: unlink the alarm from everything
+ * that holds it. Each of those is an indexed or doubly linked
+ * structure, so nothing is searched: the hash gives the node, the
+ * heap node knows its slot, and the group link knows what points
+ * at it. The caller must hold the monitor's alarm_list_sem; the
+ * outcome is left in the request for report_request, which also
+ * gives back the alarm's display slot.
+ */
+void alarm_cancel(monitor_t *monitor, request_t *request)
+{
+    alarm_t *alarm = hash_remove(&monitor->alarm_index, request->alarm_id);
+
+    if (alarm == NULL)
+    {
+        request->event = EVENT_INVALID_CANCEL;
+        return;
     }
+    heap_remove(&monitor->alarm_heap, &alarm->position);
+    group_remove(&monitor->group_index, alarm->group_id, &alarm->member);
+    request->group_id = alarm->group_id;
+    request->cancelled = alarm;
+    request->event = EVENT_CANCELLED;
 }
 
-void change_alarm_insert(change_alarm_t *change_alarm)
+/*
+ * Fill in the reply a client is waiting for, now that the monitor
+ * has decided what the request did. Deadlines are given as
+ * CLOCK_REALTIME seconds.
+ */
+void request_reply(request_t *request)
 {
-    change_alarm_t **last, *next;
+    struct timespec real;
+    uint64_t deadline;
+    int event = request->type == REQUEST_SUPERSEDED ? -1 : request->event;
 
-    sem_wait(&change_list_sem); // Wait on the semaphore before accessing change_alarm_list
+    if (event == EVENT_INSERTED || event == EVENT_CHANGED)
+    {
+        clock_gettime(CLOCK_REALTIME, &real);
+        deadline = request->time - monotonic_ns() + (uint64_t)real.tv_sec * NSEC_PER_SEC + real.tv_nsec;
+        server_fill(request->ticket, "Alarm(%d) %s: Deadline %llu.%03llu\n", request->alarm_id,
+                    event == EVENT_INSERTED ? "Accepted" : "Changed",
+                    (unsigned long long)(deadline / NSEC_PER_SEC),
+                    (unsigned long long)(deadline % NSEC_PER_SEC / NSEC_PER_MSEC));
+    }
+    else if (event == EVENT_EXISTS)
+        server_fill(request->ticket, "Alarm(%d) Already Exists\n", request->alarm_id);
+    else if (event == EVENT_INVALID_CHANGE)
+        server_fill(request->ticket, "Alarm(%d) Change Refused\n", request->alarm_id);
+    else if (event == EVENT_CANCELLED)
+        server_fill(request->ticket, "Alarm(%d) Cancelled\n", request->alarm_id);
+    else if (event == EVENT_INVALID_CANCEL)
+        server_fill(request->ticket, "Alarm(%d) Cancel Refused\n", request->alarm_id);
+    else
+        server_fill(request->ticket, "Alarm(%d) Change Superseded\n", request->alarm_id);
+}
 
-    // LOCKING PROTOCOL:
-    // Assumes that the caller has locked the alarm_mutex
+/*
+ * Report what applying a request did, release what it no longer
+ * needs, and free it. Called by the monitor in request order,
+ * without its alarm_list_sem; only the monitor that owns an alarm
+ * frees it and its text, so everything the request refers to is
+ * still there.
+ */
+void report_request(request_t *request)
+{
+    display_job_t *job;
 
-    last = &change_alarm_list;
-    next = *last;
-    while (next != NULL)
+    if (request->ticket != NULL)
+        request_reply(request);
+    if (request->type == REQUEST_SUPERSEDED)
+    {
+        arena_release(&message_arena, request->message);
+        slab_free(&request_slab, request);
+        return;
+    }
+    switch (request->event)
     {
-        if (next->alarm_id >= change_alarm->alarm_id)
+    case EVENT_INSERTED:
+        if (persist)
+            wal_append(&wal, WAL_START, request->alarm_id, request->group_id, request->time,
+                       request->period, message_text(request->message));
+        lockstat_mutex_lock(&display_lock);
+        job = assign_alarm_to_display_job(request->group_id);
+        lockstat_mutex_unlock(&display_lock);
+        log_event(job != NULL ? EVENT_DISPLAY_CREATED : EVENT_ASSIGNED, request->submitter,
+                  request->alarm_id, request->group_id, message_text(request->message));
+        log_event(EVENT_INSERTED, request->submitter, request->alarm_id, request->group_id,
+                  message_text(request->message));
+        // Started only now, so that its first pass comes after the lines above
+        if (job != NULL)
+            pool_submit(&display_pool, &job->work);
+        break;
+    case EVENT_EXISTS:
+        log_event(EVENT_EXISTS, request->submitter, request->alarm_id, request->group_id, NULL);
+        arena_release(&message_arena, request->message);
+        break;
+    case EVENT_CHANGED:
+        if (persist)
+            wal_append(&wal, WAL_CHANGE, request->alarm_id, request->group_id, request->time,
+                       request->period, message_text(request->message));
+        log_event(EVENT_CHANGED, pthread_self(), request->alarm_id, request->group_id,
+                  message_text(request->message));
+        if (request->left_group != request->group_id)
         {
-            change_alarm->link = next;
-            *last = change_alarm;
-            break;
+            // The alarm is displayed with its new group from now on
+            lockstat_mutex_lock(&display_lock);
+            display_job_release(request->left_group);
+            job = assign_alarm_to_display_job(request->group_id);
+            lockstat_mutex_unlock(&display_lock);
+            log_event(job != NULL ? EVENT_DISPLAY_CREATED : EVENT_ASSIGNED, request->submitter,
+                      request->alarm_id, request->group_id, message_text(request->message));
+            if (job != NULL)
+                pool_submit(&display_pool, &job->work);
         }
-        last = &next->link;
-        next = next->link;
+        arena_release(&message_arena, request->replaced);
+        break;
+    case EVENT_INVALID_CHANGE:
+        log_event(EVENT_INVALID_CHANGE, pthread_self(), request->alarm_id, request->group_id,
+                  message_text(request->message));
+        arena_release(&message_arena, request->message);
+        break;
+    case EVENT_CANCELLED:
+        if (persist)
+            wal_append(&wal, WAL_CANCEL, request->alarm_id, request->group_id,
+                       request->cancelled->time, 0, NULL);
+        log_event(EVENT_CANCELLED, pthread_self(), request->alarm_id, request->group_id,
+                  message_text(request->cancelled->message));
+        lockstat_mutex_lock(&display_lock);
+        display_job_release(request->group_id);
+        lockstat_mutex_unlock(&display_lock);
+        arena_release(&message_arena, request->cancelled->message);
+        slab_free(&alarm_slab, request->cancelled);
+        break;
+    case EVENT_INVALID_CANCEL:
+        log_event(EVENT_INVALID_CANCEL, pthread_self(), request->alarm_id, 0, NULL);
+        break;
     }
+    slab_free(&request_slab, request);
+}
 
-    // If we reached the end of the list, insert the new change alarm there
-    if (next == NULL)
+/*
+ * Copy every pending alarm into a snapshot. Runs in the first
+ * monitor, holding every shard's alarm_list_sem.
+ */
+void snapshot_alarms(wal_snapshot_t *snapshot, void *arg)
+{
+    alarm_heap_t *heap;
+    alarm_t *alarm;
+
+    for (int m = 0; m < monitor_count; m++)
     {
-        *last = change_alarm;
-        change_alarm->link = NULL;
+        heap = &monitors[m].alarm_heap;
+        for (size_t i = 0; i < heap->count; i++)
+        {
+            alarm = heap_entry(heap->slots[i].node, alarm_t, position);
+            wal_snapshot_add(snapshot, alarm->alarm_id, alarm->group_id, alarm->time,
+                             alarm->period, message_text(alarm->message));
+        }
     }
+}
 
-    sem_post(&change_list_sem); // Post to the semaphore after modifying change_alarm_list
+/*
+ * A firing of a periodic alarm, noted in phase one for phase two.
+ * The alarm itself stays in the heap and may change before it is
+ * reported, so what is reported is copied.
+ */
+typedef struct firing_tag
+{
+    uint64_t deadline;    /* The deadline that fired */
+    uint64_t next;        /* The one it was re-armed for */
+    int alarm_id;
+    int group_id;
+    arena_ref_t message;
+} firing_t;
 
-    printf("Change Alarm Request (%d) Inserted by Main Thread %p into Change Alarm List at %ld: Group(%d) %s\n",
-           change_alarm->alarm_id, pthread_self(), (long)time(NULL), change_alarm->group_id, change_alarm->message);
+/*
+ * Move a periodic alarm that has just fired on to its next deadline.
+ * Deadlines stay on the schedule anchored at the alarm's first one,
+ * whenever the monitor actually got to it, so lateness does not add
+ * up from one firing to the next; firings the monitor was too late
+ * for are skipped rather than run back to back. The caller must
+ * hold the monitor's alarm_list_sem.
+ */
+void alarm_rearm(monitor_t *monitor, alarm_t *alarm, uint64_t now)
+{
+    alarm->time += alarm->period;
+    if (alarm->time <= now)
+        alarm->time += ((now - alarm->time) / alarm->period + 1) * alarm->period;
+    heap_update(&monitor->alarm_heap, &alarm->position, alarm->time);
 }
 
 /*
- * The alarm thread's start routine.
+ * The calling thread's lateness histogram, registered on first use.
+ */
+histogram_t *thread_lateness(void)
+{
+    static __thread histogram_t *lateness;
+
+    if (lateness == NULL)
+        lateness = histogram_register(&lateness_set);
+    return lateness;
+}
+
+/*
+ * Record, log and free a list of expired alarms, and give back their
+ * display slots. Lateness is taken as each alarm is reported, so it
+ * counts the time spent waiting for a worker. Runs without any alarm
+ * lock, in a monitor or an expiry_pool worker.
+ */
+void expire_alarms(group_node_t *first)
+{
+    histogram_t *lateness = thread_lateness();
+    group_node_t *member, *next_member;
+    alarm_t *alarm;
+
+    lockstat_mutex_lock(&display_lock);
+    for (member = first; member != NULL; member = member->next)
+        display_job_release(group_entry(member, alarm_t, member)->group_id);
+    lockstat_mutex_unlock(&display_lock);
+
+    for (member = first; member != NULL; member = next_member)
+    {
+        next_member = member->next;
+        alarm = group_entry(member, alarm_t, member);
+        histogram_record(lateness, monotonic_ns() - alarm->time);
+        if (persist)
+            wal_append(&wal, WAL_EXPIRE, alarm->alarm_id, alarm->group_id, alarm->time, 0, NULL);
+        log_event(EVENT_REMOVED, pthread_self(), alarm->alarm_id, alarm->group_id, message_text(alarm->message));
+        arena_release(&message_arena, alarm->message);
+        slab_free(&alarm_slab, alarm);
+    }
+}
+
+/*
+ * An expiry_pool job: expire one chunk, and wake its monitor if it
+ * was the last one out. The chunk belongs to the monitor, which may
+ * reuse it as soon as it is woken.
+ */
+uint64_t expiry_run(pool_job_t *work)
+{
+    expiry_chunk_t *chunk = pool_entry(work, expiry_chunk_t, work);
+    monitor_t *monitor = chunk->monitor;
+
+    expire_alarms(chunk->first);
+    if (atomic_fetch_sub(&monitor->chunks_pending, 1) == 1)
+        sem_post(&monitor->chunks_done);
+    return 0;
+}
+
+/*
+ * Coalesce a batch of requests before it is applied: a Change_Alarm
+ * followed, later in the batch, by another change of the same alarm
+ * with no start or cancel of it in between is superseded, since the
+ * later change sets everything the earlier one did. Only the last
+ * is applied, logged and written to the write-ahead log, so a
+ * client that reschedules an alarm many times between two passes
+ * costs one change. A change with a zero timeout supersedes
+ * nothing, since alarm_change refuses it for a periodic alarm, and
+ * the alarm would then be left without the changes before it. Runs
+ * before alarm_list_sem is taken.
+ */
+void coalesce_changes(monitor_t *monitor, queue_node_t *requests)
+{
+    request_t *request, *earlier;
+    queue_node_t *node;
+
+    for (node = requests; node != NULL; node = node->next)
+    {
+        request = queue_entry(node, request_t, link);
+        if (request->type == REQUEST_CHANGE && request->period != 0)
+        {
+            if ((earlier = hash_remove(&monitor->latest_change, request->alarm_id)) != NULL)
+                earlier->type = REQUEST_SUPERSEDED;
+            hash_insert(&monitor->latest_change, request->alarm_id, request);
+        }
+        else if (request->type != REQUEST_EXIT)
+            hash_remove(&monitor->latest_change, request->alarm_id);
+    }
+
+    // Leave the map empty for the next batch
+    for (node = requests; node != NULL && monitor->latest_change.count > 0; node = node->next)
+    {
+        request = queue_entry(node, request_t, link);
+        if (request->type == REQUEST_CHANGE)
+            hash_remove(&monitor->latest_change, request->alarm_id);
+    }
+}
+
+/*
+ * The alarm thread's start routine: the monitor of one shard.
  */
 void *alarm_thread(void *arg)
 {
+    monitor_t *monitor = arg;
+    struct epoll_event events[3];
+    struct signalfd_siginfo signal_info;
+    histogram_t *lateness = thread_lateness();
+    firing_t *firings = NULL;  // Periodic alarms fired in one pass
+    expiry_chunk_t *chunks = NULL; // Expired alarms of one pass, EXPIRY_CHUNK to a chunk
+    server_ticket_t **answers = NULL; // Client replies of one pass
+    size_t firings_size = 0, fired, chunks_size = 0, chunk_count, expired;
+    size_t answers_size = 0, answered;
+    uint64_t count;
+
     while (1)
     {
-        alarm_t *current_alarm = NULL;
-        time_t now = time(NULL);
-        int status;
+        alarm_t *alarm;
+        group_node_t **tail = NULL;
+        queue_node_t *requests, *node, *next;
+        int ready, report = 0, stop = 0, snapshot = 0;
 
-        // Wait on the semaphores before accessing the lists
-        sem_wait(&alarm_list_sem);
-        sem_wait(&change_list_sem);
+        // Sleep until the timer fires, the main thread wakes us or a signal arrives
+        ready = epoll_wait(monitor->epoll, events, 3, -1);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            errno_abort("Wait for alarm monitor events");
+        }
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.fd == monitor_signal)
+            {
+                while (read(monitor_signal, &signal_info, sizeof(signal_info)) == sizeof(signal_info))
+                    report = 1;
+                continue;
+            }
+            // Reset the descriptor; EAGAIN just means someone else already did
+            if (read(events[i].data.fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                errno_abort("Read alarm monitor event");
+        }
+
+        // Take every request queued so far, oldest first; producers keep queueing meanwhile
+        requests = queue_take(&monitor->request_queue);
+        coalesce_changes(monitor, requests);
 
-        // Process and remove expired alarms
-        while (alarm_list != NULL && alarm_list->time <= now)
+        /*
+         * Phase one, under the semaphore: only change the alarm
+         * structures. Expired alarms are unlinked onto a local
+         * batch, and each request records what it did.
+         */
+        lockstat_sem_wait(&monitor->alarm_list_sem);
+
+        // Shards are always locked in order, and only here is more than one held
+        if (persist && monitor == &monitors[0] && wal_snapshot_due(&wal))
         {
-            current_alarm = alarm_list;
-            alarm_list = alarm_list->link;
-            printf("Alarm Monitor Thread %p Has Removed Alarm(%d) at %ld: Group(%d) %s\n",
-                   pthread_self(), current_alarm->alarm_id, (long)now, current_alarm->group_id, current_alarm->message);
-            free(current_alarm);
-            current_alarm = NULL;
+            for (int i = 1; i < monitor_count; i++)
+                lockstat_sem_wait(&monitors[i].alarm_list_sem);
+            snapshot = wal_snapshot(&wal, snapshot_alarms, NULL) == 0;
+            for (int i = 1; i < monitor_count; i++)
+                lockstat_sem_post(&monitors[i].alarm_list_sem);
         }
 
-        // Process Change_Alarm requests
-        change_alarm_t *change = change_alarm_list;
-        // While there exists a "change_alarm_list" continue looking for alarms with:
-        // same alarm_id
-        while (change != NULL)
+        uint64_t now = monotonic_ns();
+
+        // Detach expired alarms and re-arm periodic ones; the heap root is always the earliest
+        fired = chunk_count = expired = 0;
+        while (monitor->alarm_heap.count > 0 && heap_min_key(&monitor->alarm_heap) <= now)
         {
-            // Flag to check if a corresponding alarm between alarm_list and change_alarm_list exists
-            int found_pair = 0;
-            // Find the alarm with the same Alarm_ID and apply changes
-            for (alarm_t *alarm = alarm_list; alarm != NULL; alarm = alarm->link)
+            alarm = heap_entry(heap_min(&monitor->alarm_heap), alarm_t, position);
+            if (alarm->period != 0)
+            {
+                if (fired == firings_size)
+                {
+                    firings_size = firings_size == 0 ? 64 : firings_size * 2;
+                    firings = realloc(firings, firings_size * sizeof(*firings));
+                    if (firings == NULL)
+                        errno_abort("Allocate periodic firings");
+                }
+                firings[fired].deadline = alarm->time;
+                firings[fired].alarm_id = alarm->alarm_id;
+                firings[fired].group_id = alarm->group_id;
+                firings[fired].message = alarm->message;
+                alarm_rearm(monitor, alarm, now);
+                firings[fired++].next = alarm->time;
+                continue;
+            }
+            heap_pop(&monitor->alarm_heap);
+            hash_remove(&monitor->alarm_index, alarm->alarm_id);
+            group_remove(&monitor->group_index, alarm->group_id, &alarm->member);
+            if (expired++ % EXPIRY_CHUNK == 0)
             {
-                if (alarm->alarm_id == change->alarm_id)
+                if (chunk_count == chunks_size)
                 {
-                    alarm->group_id = change->group_id;
-                    alarm->time = change->time;
-                    strncpy(alarm->message, change->message, sizeof(alarm->message) - 1);
-                    printf("Alarm Monitor Thread %p Has Changed Alarm(%d) at %ld: Group(%d) %s\n",
-                           pthread_self(), alarm->alarm_id, (long)time(NULL), alarm->group_id, alarm->message);
-
-                    found_pair = 1;
-                    // We want to save the alarm in change_alarm_list, so break
-                    break;
+                    chunks_size = chunks_size == 0 ? 16 : chunks_size * 2;
+                    chunks = realloc(chunks, chunks_size * sizeof(*chunks));
+                    if (chunks == NULL)
+                        errno_abort("Allocate expiry chunks");
                 }
+                chunks[chunk_count].first = NULL;
+                tail = &chunks[chunk_count++].first;
             }
-            // If there was no corresponding alarm found, then we print error
-            if (!found_pair)
+            *tail = &alarm->member;
+            tail = &alarm->member.next;
+        }
+
+        // Apply the batch of requests in the order they were submitted
+        for (node = requests; node != NULL; node = node->next)
+        {
+            request_t *request = queue_entry(node, request_t, link);
+
+            if (request->type == REQUEST_START)
+                alarm_insert(monitor, request);
+            else if (request->type == REQUEST_CHANGE)
+                alarm_change(monitor, request);
+            else if (request->type == REQUEST_CANCEL)
+                alarm_cancel(monitor, request);
+            else if (request->type == REQUEST_EXIT)
+                stop = 1;
+        }
+
+        // Requests may have moved the earliest deadline either way
+        monitor_arm(monitor);
+
+        // Post to the semaphore after modifying the alarm heap
+        lockstat_sem_post(&monitor->alarm_list_sem);
+
+        // Fork the snapshot writer only now, so that no shard waits for the fork
+        if (snapshot && wal_snapshot_write(&wal) != 0)
+            fprintf(stderr, "Snapshot not started\n");
+
+        /*
+         * Phase two, with the semaphore released: report, record
+         * lateness, and free. A periodic alarm's text is released
+         * only by the request that changes or cancels it, which is
+         * reported after its firings. Each firing logs the alarm's
+         * next deadline, so that a restart does not fire it again.
+         */
+        for (size_t i = 0; i < fired; i++)
+        {
+            if (persist)
+                wal_append(&wal, WAL_REARM, firings[i].alarm_id, firings[i].group_id,
+                           firings[i].next, 0, NULL);
+            histogram_record(lateness, monotonic_ns() - firings[i].deadline);
+            log_event(EVENT_FIRED, pthread_self(), firings[i].alarm_id, firings[i].group_id,
+                      message_text(firings[i].message));
+        }
+        if (chunk_count > 1 && expiry_workers != 0)
+        {
+            atomic_store(&monitor->chunks_pending, (int)chunk_count - 1);
+            for (size_t i = 0; i + 1 < chunk_count; i++)
             {
-                printf("Invalid Change Alarm Request(%d) at %ld: Group(%d) %s\n",
-                       change->alarm_id, (long)time(NULL), change->group_id, change->message);
+                chunks[i].work.run = expiry_run;
+                chunks[i].monitor = monitor;
+                pool_submit(&expiry_pool, &chunks[i].work);
             }
+            expire_alarms(chunks[chunk_count - 1].first);
+            while (sem_wait(&monitor->chunks_done) == -1)
+                if (errno != EINTR)
+                    errno_abort("Wait for expiry chunks");
+        }
+        else
+        {
+            for (size_t i = 0; i < chunk_count; i++)
+                expire_alarms(chunks[i].first);
+        }
+        answered = 0;
+        for (node = requests; node != NULL; node = next)
+        {
+            request_t *request = queue_entry(node, request_t, link);
 
-            // Remove the alarm used to update the alarm in the alarm_list from change_alarm_list
-            change_alarm_t *temp = change;
-            change = change->link;
-            free(temp);
+            next = node->next;
+            if (request->type == REQUEST_EXIT)
+            {
+                slab_free(&request_slab, request);
+                continue;
+            }
+            if (request->ticket != NULL)
+            {
+                if (answered == answers_size)
+                {
+                    answers_size = answers_size == 0 ? 64 : answers_size * 2;
+                    answers = realloc(answers, answers_size * sizeof(*answers));
+                    if (answers == NULL)
+                        errno_abort("Allocate client replies");
+                }
+                answers[answered++] = request->ticket;
+            }
+            report_request(request);
         }
-        change_alarm_list = NULL;
 
-        // Post to the semaphores after modifying the lists
-        sem_post(&change_list_sem);
-        sem_post(&alarm_list_sem);
+        // Clients hear of their requests only once the records are durable
+        if (answered > 0 && persist)
+            wal_sync(&wal);
+        for (size_t i = 0; i < answered; i++)
+            server_answer(&server, answers[i]);
+        if (stop)
+        {
+            // The last monitor to stop flushes the logs and exits for all of them
+            if (atomic_fetch_sub(&monitors_running, 1) > 1)
+                break;
+#ifdef DEBUG
+            slab_report(&alarm_slab, stderr);
+            slab_report(&request_slab, stderr);
+            slab_report(&display_slab, stderr);
+#endif
+            if (persist)
+                wal_close(&wal);
+            log_drain();
+            exit(0);
+        }
 
-        // Sleep or wait for a condition to efficiently use CPU
-        sleep(1); // Adjust sleep time as needed
+        if (report)
+            report_lateness();
     }
 
-    return NULL; // Return statement to avoid compiler warnings
+    free(firings);
+    free(chunks);
+    free(answers);
+    return NULL;
+}
+
+/*
+ * Create a display job for "alarm_count" alarms of a group, and put
+ * it first on the group's list. The caller must hold display_lock,
+ * and start the job with pool_submit.
+ */
+display_job_t *display_job_create(int group_id, int alarm_count)
+{
+    display_job_t *first = hash_remove(&display_jobs, group_id);
+    display_job_t *job = (display_job_t *)slab_alloc(&display_slab);
+
+    job->work.run = display_pass;
+    job->group_id = group_id;
+    job->alarm_count = alarm_count;
+    job->due = monotonic_ns();
+    job->next = first;
+    hash_insert(&display_jobs, group_id, job);
+    return job;
 }
 
-void assign_alarm_to_display_thread(alarm_t *alarm)
+/*
+ * Give a new alarm of a group to a display job of the group that
+ * has room for it, or create a new job. Returns the new job, which
+ * the caller must start with pool_submit, or NULL. The caller must
+ * hold display_lock.
+ */
+display_job_t *assign_alarm_to_display_job(int group_id)
 {
-    int assigned = 0;
-    for (int i = 0; i < MAX_DISPLAY_THREADS; i++)
+    display_job_t *job;
+
+    for (job = hash_find(&display_jobs, group_id); job != NULL; job = job->next)
     {
-        // Ensure that alarm is associated with the CORRECT group ID
-        if (display_threads[i].active == 1 && display_threads[i].group_id == alarm->group_id)
+        if (job->alarm_count < DISPLAY_ALARMS)
         {
-            // Each display thread (which is associated with a particular group_id) should have MAX TWO alarms associated to it
-            if (display_threads[i].alarm_count < 2)
-            {
-                display_threads[i].alarm_count++;
-                assigned = 1;
-                printf("Main Thread %p Assigned to Display Alarm(%d) at %ld: Group(%d) %s\n",
-                       pthread_self(), alarm->alarm_id, (long)time(NULL), alarm->group_id, alarm->message);
-                break;
-            }
+            job->alarm_count++;
+            return NULL;
         }
     }
 
-    // If
-    // 1. If there does not exist any display thread associated with the alarm's group_id
-    // 2. If the all display threads associated with the given alarm's group_id already have more than 1 alarm associated with it
-    // Then create a new display_thread
-    // @note, it is possible that multiple there are the same group_ids across multiple threads
-    if (!assigned)
-    {
-        create_display_thread(alarm->group_id);
-        alarm->assigned_to_thread = 1;
-        printf("Main Thread Created New Display Alarm Thread %p For Alarm(%d) at %ld: Group(%d) %s\n",
-               pthread_self(), alarm->alarm_id, (long)time(NULL), alarm->group_id, alarm->message);
-    }
+    // Every job of the group is full, or the group has none
+    return display_job_create(group_id, 1);
 }
 
-void create_display_thread(int group_id)
+/*
+ * Give back the display slot of an alarm that expired, was
+ * cancelled or moved to another group: the first job of the group
+ * that still counts an alarm counts one fewer. A job left with none finishes at its next pass. The
+ * caller must hold display_lock.
+ */
+void display_job_release(int group_id)
 {
-    for (int i = 0; i < MAX_DISPLAY_THREADS; i++)
+    display_job_t *job;
+
+    for (job = hash_find(&display_jobs, group_id); job != NULL; job = job->next)
     {
-        if (display_threads[i].active == 0)
+        if (job->alarm_count > 0)
         {
-            display_threads[i].group_id = group_id;
-            display_threads[i].active = 1;
-            display_threads[i].alarm_count = 1;
-
-            int *arg = malloc(sizeof(int));
-            *arg = group_id;
-            pthread_create(&display_threads[i].thread_id, NULL, display_thread, arg);
-            // Add error handling for pthread_create
-            break;
+            job->alarm_count--;
+            return;
         }
     }
 }
 
-void *display_thread(void *arg)
+/*
+ * Take a finished job off its group's list. The caller must hold
+ * display_lock.
+ */
+void display_job_unlink(display_job_t *job)
 {
-    int group_id = *(int *)arg;
-    free(arg); // Assuming group_id was dynamically allocated
+    display_job_t *first = hash_find(&display_jobs, job->group_id), **link;
 
-    while (1)
+    if (first == job)
+    {
+        hash_remove(&display_jobs, job->group_id);
+        if (job->next != NULL)
+            hash_insert(&display_jobs, job->group_id, job->next);
+        return;
+    }
+    for (link = &first->next; *link != job; link = &(*link)->next)
+        ;
+    *link = job->next;
+}
+
+/*
+ * One display pass, run by a display_pool worker: print the group's
+ * pending alarms, shard by shard, and come back DISPLAY_PERIOD after
+ * this pass was due (so the cadence does not drift), or finish once
+ * every alarm it was given has expired, been cancelled or left the
+ * group. A pass that finds nothing to print (its alarms are due but
+ * not yet expired) does not finish the job, since their releases
+ * are still to come and would otherwise be taken from a sibling.
+ * display_lock is held throughout, so that no alarm of the group
+ * can be given to this job while it decides to finish.
+ */
+uint64_t display_pass(pool_job_t *work)
+{
+    display_job_t *job = pool_entry(work, display_job_t, work);
+    int group_id = job->group_id;
+    uint64_t now = monotonic_ns();
+    int done;
+
+    lockstat_mutex_lock(&display_lock);
+    for (int m = 0; m < monitor_count; m++)
     {
-        sem_wait(&alarm_list_sem); // Wait on the semaphore before accessing alarm_list
+        monitor_t *monitor = &monitors[m];
 
-        int found = 0;
-        time_t now = time(NULL);
+        lockstat_sem_wait(&monitor->alarm_list_sem); // Wait on the semaphore before accessing the group index
 
-        // Iterate over the alarm list and print messages for the matching group
-        for (alarm_t *alarm = alarm_list; alarm != NULL; alarm = alarm->link)
+        alarm_group_t *group = group_find(&monitor->group_index, group_id);
+
+        // Print the messages of the group's alarms; no other alarm is looked at
+        for (group_node_t *node = group != NULL ? group->first : NULL; node != NULL; node = node->next)
         {
-            if (alarm->group_id == group_id && alarm->time > now)
+            alarm_t *alarm = group_entry(node, alarm_t, member);
+            if (alarm->time > now)
             {
-                printf("Alarm (%d) Printed by Alarm Display Thread %p at %ld: Group(%d) %s\n",
-                       alarm->alarm_id, pthread_self(), (long)now, alarm->group_id, alarm->message);
-                found = 1;
+                log_event(EVENT_PRINTED, pthread_self(), alarm->alarm_id, alarm->group_id, message_text(alarm->message));
             }
         }
 
-        sem_post(&alarm_list_sem); // Post to the semaphore after reading alarm_list
+        lockstat_sem_post(&monitor->alarm_list_sem); // Post to the semaphore after reading the group index
+    }
 
-        // If no alarms were found for the group, exit the thread
-        if (!found)
-        {
-            printf("No More Alarms in Group(%d): Display Thread %p exiting at %ld\n",
-                   group_id, pthread_self(), (long)now);
+    // The job is done once all of its alarms have been released
+    done = job->alarm_count == 0;
+    if (done)
+        display_job_unlink(job);
+    lockstat_mutex_unlock(&display_lock);
+
+    if (done)
+    {
+        log_event(EVENT_DISPLAY_EXIT, pthread_self(), 0, group_id, NULL);
+        slab_free(&display_slab, job);
+        return 0;
+    }
+    job->due += DISPLAY_PERIOD;
+    if (job->due <= now)
+        job->due = now + DISPLAY_PERIOD; // Far behind: do not run passes back to back
+    return job->due;
+}
+
+/*
+ * Apply one record of the write-ahead log to alarm_index. Only the
+ * index is kept up to date while the log is replayed; the heap,
+ * groups and display jobs are built from it once, at the end. A
+ * record that already took effect changes nothing.
+ */
+void recover_alarm(void *arg, int type, int alarm_id, int group_id, uint64_t deadline,
+                   uint64_t period, const char *message, size_t length)
+{
+    alarm_hash_t *index = &monitor_of(alarm_id)->alarm_index;
+    alarm_t *alarm = hash_find(index, alarm_id);
+    char text[256];
+
+    memcpy(text, message, length);
+    text[length] = '\0';
+    switch (type)
+    {
+    case WAL_START:
+        if (alarm != NULL)
+            break;
+        alarm = (alarm_t *)slab_alloc(&alarm_slab);
+        alarm->alarm_id = alarm_id;
+        alarm->group_id = group_id;
+        alarm->time = deadline;
+        alarm->period = period;
+        alarm->message = arena_store(&message_arena, text);
+        hash_insert(index, alarm_id, alarm);
+        break;
+    case WAL_CHANGE:
+        if (alarm == NULL)
+            break;
+        alarm->group_id = group_id;
+        alarm->time = deadline;
+        alarm->period = period;
+        arena_release(&message_arena, alarm->message);
+        alarm->message = arena_store(&message_arena, text);
+        break;
+    case WAL_EXPIRE:
+    case WAL_CANCEL:
+        if (alarm == NULL)
             break;
+        hash_remove(index, alarm_id);
+        arena_release(&message_arena, alarm->message);
+        slab_free(&alarm_slab, alarm);
+        break;
+    case WAL_REARM:
+        if (alarm != NULL)
+            alarm->time = deadline;
+        break;
+    }
+}
+
+/*
+ * Rebuild the pending alarms from the snapshot and log in "dir",
+ * and start logging. Runs before the monitor threads exist. Each
+ * heap is built in one O(n) pass rather than by n inserts, and each
+ * group gets all the display jobs it needs at once rather than one
+ * assignment per alarm; alarms whose deadline passed while the
+ * program was down expire on their monitor's first pass, and
+ * periodic ones fire once there and go back to their old schedule.
+ */
+void recover(const char *dir)
+{
+    uint64_t begin = monotonic_ns();
+    monitor_t *monitor;
+    alarm_group_t *group;
+    display_job_t *job;
+    alarm_t *alarm;
+    size_t bound, count = 0;
+    long records;
+    int remaining;
+
+    bound = wal_open(&wal, dir);
+    for (int m = 0; m < monitor_count; m++)
+        hash_reserve(&monitors[m].alarm_index, bound / monitor_count);
+    records = wal_replay(&wal, recover_alarm, NULL);
+
+    for (int m = 0; m < monitor_count; m++)
+    {
+        monitor = &monitors[m];
+        for (size_t i = 0; i <= monitor->alarm_index.mask; i++)
+        {
+            if ((alarm = monitor->alarm_index.slots[i].value) == NULL)
+                continue;
+            heap_append(&monitor->alarm_heap, &alarm->position, alarm->time);
+            group_add(&monitor->group_index, alarm->group_id, &alarm->member);
         }
+        heap_heapify(&monitor->alarm_heap);
+        monitor_arm(monitor);
+        count += monitor->alarm_heap.count;
+    }
+
+    // Display jobs start running as soon as they are submitted
+    lockstat_mutex_lock(&display_lock);
+    for (int m = 0; m < monitor_count; m++)
+    {
+        monitor = &monitors[m];
+        for (size_t i = 0; i <= monitor->group_index.groups.mask; i++)
+        {
+            if ((group = monitor->group_index.groups.slots[i].value) == NULL)
+                continue;
+            remaining = group->count;
 
-        // Sleep for 5 seconds as per the requirements
-        sleep(5);
+            // The group's newest job, left part full by an earlier shard, is filled first
+            job = hash_find(&display_jobs, group->group_id);
+            for (; job != NULL && job->alarm_count < DISPLAY_ALARMS && remaining > 0; remaining--)
+                job->alarm_count++;
+            for (; remaining > 0; remaining -= DISPLAY_ALARMS)
+                pool_submit(&display_pool, &display_job_create(group->group_id,
+                            remaining < DISPLAY_ALARMS ? remaining : DISPLAY_ALARMS)->work);
+        }
     }
+    lockstat_mutex_unlock(&display_lock);
 
-    return NULL;
+    wal_start(&wal);
+    persist = 1;
+    fprintf(stderr, "Recovered %zu alarms from %ld records in %.1f ms\n", count,
+            records, (double)(monotonic_ns() - begin) / NSEC_PER_MSEC);
 }
 
-int main(int argc, char *argv[])
+/*
+ * Parse one line of input into a request for the monitor. "length"
+ * does not include the newline. Returns NULL if the line is not a
+ * request; "*error" is then what was wrong with it, or NULL for a
+ * blank line or a command that has been carried out already.
+ */
+request_t *parse_request(const char *line, size_t length, const char **error)
 {
-    int status;
-    char line[256]; // Increased line length for longer messages
-    alarm_t *alarm;
-    pthread_t thread;
+    command_t command;
+    request_t *request;
 
-    sem_init(&alarm_list_sem, 0, 1);  // Initialize semaphore for alarm list
-    sem_init(&change_list_sem, 0, 1); // Initialize semaphore for change alarm list
+    *error = NULL;
+    if (length == 0)
+        return NULL;
 
-    status = pthread_create(
-        &thread, NULL, alarm_thread, NULL);
-    if (status != 0)
-        err_abort(status, "Create alarm thread");
-    while (1)
+    // Check if all inputs are correct
+    // The timeout is seconds (possibly fractional) or milliseconds with an "ms" suffix
+    if (parse_command(line, length, &command) != 0)
     {
-        printf("Alarm> ");
-        if (fgets(line, sizeof(line), stdin) == NULL)
-            exit(0);
+        if (command.type == COMMAND_START)
+            *error = "Bad Start_Alarm command";
+        else if (command.type == COMMAND_PERIODIC)
+            *error = "Bad Start_Periodic_Alarm command";
+        else if (command.type == COMMAND_CHANGE)
+            *error = "Bad Change_Alarm command";
+        else if (command.type == COMMAND_CANCEL)
+            *error = "Bad Cancel_Alarm command";
+        else
+            *error = "Invalid command";
+        return NULL;
+    }
+    if (command.type == COMMAND_STATS)
+    {
+        report_lateness();
+        return NULL;
+    }
+
+    request = (request_t *)slab_alloc(&request_slab);
+    request->alarm_id = command.alarm_id;
+    request->ticket = NULL;
+    if (command.type == COMMAND_CANCEL)
+    {
+        request->type = REQUEST_CANCEL;
+        request->group_id = 0;
+        request->time = 0;
+        request->period = 0;
+        request->message = 0;
+        return request;
+    }
+    request->type = command.type == COMMAND_CHANGE ? REQUEST_CHANGE : REQUEST_START;
+    request->group_id = command.group_id;
+    request->time = monotonic_ns() + command.timeout;
+    request->period = command.type == COMMAND_START ? 0 : command.timeout;
+    if (request->type == REQUEST_CHANGE)
+    {
+        // Report the request now; once it is queued the monitor may free it at any time
+        log_event(EVENT_CHANGE_REQUEST, pthread_self(), request->alarm_id, request->group_id,
+                  command.message);
+    }
+    request->message = arena_store(&message_arena, command.message);
+    return request;
+}
+
+/*
+ * Parse one line of input and queue it for the monitor.
+ */
+void handle_line(const char *line, size_t length)
+{
+    request_t *request;
+    const char *error;
+
+    if ((request = parse_request(line, length, &error)) != NULL)
+        submit_request(request);
+    else if (error != NULL)
+        fprintf(stderr, "%s\n", error);
+}
+
+/*
+ * With -s, clients connect to a Unix domain socket and send the
+ * same commands as standard input takes, as many at a time as they
+ * like. Every non-empty line gets a reply, in order: what was wrong
+ * with it, or, once the monitor has applied the request, what it
+ * did and the deadline the alarm now has (CLOCK_REALTIME seconds).
+ * With -p the monitor answers only after the records of the pass
+ * are durable, so an acknowledged request survives a crash. The
+ * requests from one read of one client go to each monitor
+ * together, with one push onto its request_queue, and so are
+ * applied in one hold of its alarm_list_sem.
+ */
+request_t *batch_newest[MONITORS_MAX], *batch_oldest[MONITORS_MAX]; // Current client batch, by monitor
+
+void client_line(server_client_t *client, const char *line, size_t length)
+{
+    request_t *request;
+    const char *error;
+    long m;
+
+    if ((request = parse_request(line, length, &error)) == NULL)
+    {
+        if (error != NULL)
+            server_reply(client, "%s\n", error);
+        else if (length > 0)
+            server_reply(client, "Stats Reported\n");
+        return;
+    }
+    request->ticket = server_defer(client);
 
-        line[strcspn(line, "\n")] = 0; // Remove newline character
+    m = monitor_of(request->alarm_id) - monitors;
+    request->submitter = pthread_self();
+    request->link.next = batch_newest[m] != NULL ? &batch_newest[m]->link : NULL;
+    batch_newest[m] = request;
+    if (batch_oldest[m] == NULL)
+        batch_oldest[m] = request;
+}
 
-        if (strlen(line) <= 1)
+void client_batch(void)
+{
+    for (int m = 0; m < monitor_count; m++)
+    {
+        if (batch_newest[m] == NULL)
             continue;
+        if (queue_push_chain(&monitors[m].request_queue, &batch_newest[m]->link,
+                             &batch_oldest[m]->link))
+            monitor_wake(&monitors[m]);
+        batch_newest[m] = batch_oldest[m] = NULL;
+    }
+}
 
-        if (strncmp(line, "Start_Alarm", 11) == 0)
+/*
+ * Hand every complete line in "block" to handle_line, and return
+ * the number of bytes used. At the end of the input, "last" says
+ * that a final line without a newline counts too.
+ */
+size_t handle_block(const char *block, size_t size, int last)
+{
+    const char *next = block, *end = block + size, *newline;
+
+    while ((newline = memchr(next, '\n', end - next)) != NULL)
+    {
+        handle_line(next, newline - next);
+        next = newline + 1;
+    }
+    if (last && next < end)
+    {
+        handle_line(next, end - next);
+        next = end;
+    }
+    return next - block;
+}
+
+/*
+ * Non-interactive input: no prompts, and no line-at-a-time stdio.
+ * A regular file is mapped and parsed in place; anything else (a
+ * pipe) is read in large blocks, keeping a partial last line for
+ * the next block.
+ */
+#define BATCH_BLOCK (1024 * 1024)
+
+void read_batch(int fd)
+{
+    static char block[BATCH_BLOCK];
+    struct stat info;
+    size_t used = 0, done;
+    ssize_t bytes;
+    off_t offset;
+
+    offset = lseek(fd, 0, SEEK_CUR);
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && offset >= 0 && info.st_size > offset)
+    {
+        char *base = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base != MAP_FAILED)
         {
-            // Allocate memory for alarm
-            alarm_t *alarm = (alarm_t *)malloc(sizeof(alarm_t));
-            if (alarm == NULL)
-                errno_abort("Allocate alarm");
-
-            // Check if all inputs are correct for Start_Alarm
-            // If portion of input format is incorrect, free memory and print error
-            if (sscanf(line, "Start_Alarm(%d): Group(%d) %d %128[^\n]",
-                       &alarm->alarm_id, &alarm->group_id, &alarm->seconds, alarm->message) < 4)
-            {
-                fprintf(stderr, "Bad Start_Alarm command\n");
-                free(alarm);
-            }
-            // If all inputs are correct..
-            else
-            {
-                alarm->time = time(NULL) + alarm->seconds;
-                assign_alarm_to_display_thread(alarm);
-                alarm_insert(alarm);
-            }
+            madvise(base, info.st_size, MADV_SEQUENTIAL);
+            handle_block(base + offset, info.st_size - offset, 1);
+            munmap(base, info.st_size);
+            return;
         }
-        else if (strncmp(line, "Change_Alarm", 12) == 0)
-        {
-            change_alarm_t *change_alarm = (change_alarm_t *)malloc(sizeof(change_alarm_t));
-            if (change_alarm == NULL)
-                errno_abort("Allocate change alarm");
+    }
 
-            int seconds;
-            if (sscanf(line, "Change_Alarm(%d): Group(%d) %d %128[^\n]",
-                       &change_alarm->alarm_id, &change_alarm->group_id, &seconds, change_alarm->message) < 4)
-            {
-                fprintf(stderr, "Bad Change_Alarm command\n");
-                free(change_alarm);
-            }
-            else
-            {
-                change_alarm->time = time(NULL) + seconds;
-                change_alarm_insert(change_alarm);
-            }
+    while (1)
+    {
+        bytes = read(fd, block + used, BATCH_BLOCK - used);
+        if (bytes == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            errno_abort("Read commands");
+        }
+        if (bytes == 0)
+        {
+            handle_block(block, used, 1);
+            return;
+        }
+        used += bytes;
+        done = handle_block(block, used, 0);
+        if (done == 0 && used == BATCH_BLOCK)
+        {
+            // A line longer than the block: take what there is of it
+            done = handle_block(block, used, 1);
         }
+        memmove(block, block + done, used - done);
+        used -= done;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int status;
+    char line[256]; // Increased line length for longer messages
+    request_t *request;
+    const char *persist_dir = NULL, *socket_path = NULL;
+
+    // Prompt for commands only when a person is typing them, unless told otherwise
+    int batch = !isatty(STDIN_FILENO);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-b") == 0)
+            batch = 1;
+        else if (strcmp(argv[i], "-i") == 0)
+            batch = 0;
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            persist_dir = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            socket_path = argv[++i];
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 1 &&
+                 atoi(argv[i + 1]) <= MONITORS_MAX)
+            monitor_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0)
+            expiry_workers = atoi(argv[++i]);
         else
         {
-            fprintf(stderr, "Invalid command\n");
+            fprintf(stderr, "Usage: %s [-b | -i] [-p directory] [-s socket] [-m monitors] "
+                    "[-e expiry_workers]\n", argv[0]);
+            exit(1);
         }
     }
-    // Cleanup and exit code
-    return 0;
-}
\ No newline at end of file
+
+    // Blocks SIGINT and SIGTERM, so it has to come before any thread is created
+    if (socket_path != NULL)
+        server_init(&server, socket_path, client_line, client_batch);
+    lockstat_init(); // Before any thread is created
+    slab_init(&alarm_slab, "alarm", sizeof(alarm_t));
+    slab_init(&request_slab, "request", sizeof(request_t));
+    slab_init(&display_slab, "display", sizeof(display_job_t));
+    hash_init(&display_jobs);
+    arena_init(&message_arena);
+    histogram_set_init(&lateness_set);
+    monitor_init();
+    log_init(format_event);
+    pool_init(&display_pool, 0, DISPLAY_TICK);
+    if (expiry_workers != 0)
+        pool_init(&expiry_pool, expiry_workers < 0 ? 0 : expiry_workers, 0); // Expiry jobs never come back
+    if (persist_dir != NULL)
+        recover(persist_dir);
+
+    for (int m = 0; m < monitor_count; m++)
+    {
+        status = pthread_create(
+            &monitors[m].thread, NULL, alarm_thread, &monitors[m]);
+        if (status != 0)
+            err_abort(status, "Create alarm thread");
+    }
+    if (socket_path != NULL)
+        server_run(&server);
+    else if (batch)
+        read_batch(STDIN_FILENO);
+    else
+    {
+        while (1)
+        {
+            log_event(EVENT_PROMPT, pthread_self(), 0, 0, NULL);
+            if (fgets(line, sizeof(line), stdin) == NULL)
+                break;
+            line[strcspn(line, "\n")] = 0; // Remove newline character
+            handle_line(line, strlen(line));
+        }
+    }
+
+    /*
+     * Let every monitor apply what is still queued, and the last of
+     * them flush the log, before the program exits.
+     */
+    for (int m = 0; m < monitor_count; m++)
+    {
+        request = (request_t *)slab_alloc(&request_slab);
+        request->type = REQUEST_EXIT;
+        request->message = 0;
+        request->ticket = NULL;
+        request->submitter = pthread_self();
+        if (queue_push(&monitors[m].request_queue, &request->link))
+            monitor_wake(&monitors[m]);
+    }
+    pthread_exit(NULL);
+}